@@ -1,3 +1,3 @@
 from pmxAssembler import *
 
-assemble("program.asm", "program.rom")
\ No newline at end of file
+assemble("program.asm", "program.rom", "program.bin", "program.sym")
\ No newline at end of file
@@ -1,4 +1,12 @@
 from icecream import ic
+import struct
+import zlib
+
+ROM_MAGIC = 0x52584D50 # "PMXR"
+ROM_VERSION = 1
+ROM_HEADER = struct.Struct("<IHHIIIIII")
+DISPLAY_BLOCK = 0x2AD00
+symbols = {}  # label -> address, written to the symbol file for the profiler
 assembly_to_opcode = {
     "HALT": "0x00",
     "LOAD": {"R1": "0x01", "R2": "0x02", "R3": "0x03", "R4": "0x04","R5": "0x05","R6": "0x06","R7": "0x07","R8": "0x08"},
@@ -14,7 +22,24 @@ assembly_to_opcode = {
     "OVR": "0x12",
     "INC": "0x13",
     "DCR": "0x14",
+    "MUL": "0x15",
+    "DIV": "0x16",
+    "MOD": "0x17",
+    "AND": "0x18",
+    "OR": "0x19",
+    "XOR": "0x1A",
+    "SHL": "0x1B",
+    "SHR": "0x1C",
     "MOV": "0x20",
+    "POW": "0x23",
+    "SQRT": "0x24",
+    "ABS": "0x25",
+    "COPY": "0x30",
+    "FILL": "0x31",
+    "CMP": "0x32",
+    "VADD": "0x33",
+    "VSCALE": "0x34",
+    "VDOT": "0x35",
     "STR": '0xAA',
     "DVO": "0xAF",
     "DVW": "0xBF",
@@ -85,7 +110,7 @@ def assembler_START(lines, display_addr):
     return program, variables, count, display_addr
 
 def assembler(asm_file, variables, pc=0):
-    display_addr = 0x2AD00
+    display_addr = DISPLAY_BLOCK
     count = 0
     with open(asm_file, "r") as file:
         lines = file.readlines()
@@ -204,6 +229,7 @@ def add_to_display_mem(display_addr, program, item):
 def label_instruction(program, variables, parts, pc):
     var = parts[1]
     variables[var] = len(program) + pc
+    symbols[var] = variables[var]
 
 def import_instruction(program, variables, parts):
     file = parts[1].strip('"')
@@ -287,13 +313,44 @@ def replace_variables(program, variables):
             
     
 
+def write_symbol_file(sym_file, labels):
+    with open(sym_file, "w") as file:
+        for name, addr in sorted(labels.items(), key=lambda item: item[1]):
+            file.write("0x%x %s\n" % (addr, name))
+
+
 def write_rom_file(rom_file, program):
     with open(rom_file, "w") as file:
         file.write(",".join(program))
 
 
-def assemble(asm_file, rom_file):
+def rom_word(item):
+    item = str(item)
+    value = int(item, 16) if item.startswith("0x") else int(item)
+    return value & 0xFFFFFFFF
+
+
+# Binary ROM (see src/rom.h). assemble() only ever produces a code segment: WCHR
+# and the other display instructions emit code that stores their records at run
+# time, so the data segment stays empty unless a caller passes data words here.
+def write_bin_rom_file(bin_file, program, data=(), data_addr=DISPLAY_BLOCK):
+    code = struct.pack("<%dI" % len(program), *[rom_word(item) for item in program])
+    data = struct.pack("<%dI" % len(data), *[rom_word(item) for item in data])
+    checksum = zlib.adler32(data, zlib.adler32(code))
+    header = ROM_HEADER.pack(ROM_MAGIC, ROM_VERSION, ROM_HEADER.size,
+                             0, len(program), data_addr, len(data) // 4,
+                             checksum, 0)
+    with open(bin_file, "wb") as file:
+        file.write(header + code + data)
+
+
+def assemble(asm_file, rom_file, bin_file=None, sym_file=None):
     variables = {}
+    symbols.clear()
     program, variables = assembler(asm_file, variables)
     program = replace_variables(program, variables)
-    write_rom_file(rom_file, program)
\ No newline at end of file
+    write_rom_file(rom_file, program)
+    if bin_file is not None:
+        write_bin_rom_file(bin_file, program)
+    if sym_file is not None:
+        write_symbol_file(sym_file, symbols)
\ No newline at end of file
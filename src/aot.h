@@ -0,0 +1,15 @@
+#include "./pmx.h"
+
+#ifndef PMX_AOT_H
+#define PMX_AOT_H
+
+/*
+ * Defined by the C file pmxaot writes for one ROM. aot_load() puts the ROM
+ * into memory the way load_rom() does and attaches aot_execute() as the
+ * PMX's native code. A ROM that fails verify_program() gets none and runs
+ * in the checked interpreter, the translation has no bounds checks.
+ */
+int aot_load(PMX *pmx);
+long aot_execute(PMX *pmx, long budget, int *running);
+
+#endif
@@ -0,0 +1,238 @@
+/**
+ * @file console.c
+ * @brief Console device: buffered text output and non-blocking input.
+ *
+ * Every PMX gets a console from init_pmx_config(). Output from the ports
+ * listed in console.h collects in a buffer per channel, so a ROM that logs
+ * a value per loop iteration costs one host write per buffer or frame rather
+ * than one per value. Strings and buffers go straight from VM memory into
+ * the channel in a single DVW.
+ *
+ * Input is polled: when a program asks for a character and none is
+ * buffered, whatever stdin already holds is read without waiting. Stores
+ * into the loaded program are ignored, the console never changes code.
+ *
+ * With input_fed set, the console never reads stdin on its own. The caller
+ * queues input at frame boundaries, with console_receive() from stdin or
+ * with console_feed() from an input log, so a recorded run can be replayed
+ * to the instruction.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <conio.h>
+#include <io.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+#include "./console.h"
+
+static void
+channel_init(ConsoleChannel *channel, FILE *file) {
+    channel->file = file;
+#ifdef _WIN32
+    channel->line_flush = _isatty(_fileno(file));
+#else
+    channel->line_flush = isatty(fileno(file));
+#endif
+    channel->length = 0;
+}
+
+static void
+channel_flush(ConsoleChannel *channel) {
+    if (channel->length == 0) return;
+    fwrite(channel->buffer, 1, channel->length, channel->file);
+    fflush(channel->file);
+    channel->length = 0;
+}
+
+static void
+channel_put(ConsoleChannel *channel, const char *text, int length) {
+    while (length > 0) {
+        int room = CONSOLE_BUFFER - channel->length;
+        int chunk = length < room ? length : room;
+        memcpy(channel->buffer + channel->length, text, chunk);
+        channel->length += chunk;
+        text += chunk;
+        length -= chunk;
+        if (channel->length == CONSOLE_BUFFER) channel_flush(channel);
+    }
+}
+
+// Words from VM memory as text, count of them or up to the first 0 when count is -1
+static void
+channel_put_words(ConsoleChannel *channel, const PMX *pmx, unsigned int addr, long count) {
+    const unsigned int *words = pmx->memory;
+    unsigned int end = (unsigned int)pmx->memory_size;
+    int newline = 0;
+
+    if (addr >= end) return;
+    if (count >= 0 && count < end - addr) end = addr + count;
+    for (; addr < end; addr++) {
+        if (count < 0 && words[addr] == 0) break;
+        if (channel->length == CONSOLE_BUFFER) channel_flush(channel);
+        char c = (char)(words[addr] & 0xFF);
+        channel->buffer[channel->length++] = c;
+        newline |= c == '\n';
+    }
+    if (newline && channel->line_flush) channel_flush(channel);
+}
+
+/**
+ * @brief Give the PMX a console on ports CONSOLE_FIRST to CONSOLE_LAST.
+ *
+ * @return The console, NULL if it could not be allocated.
+ */
+PMXConsole *
+console_open(PMX *pmx) {
+    PMXConsole *console = calloc(1, sizeof(PMXConsole));
+    if (console == NULL) return NULL;
+    channel_init(&console->out, stdout);
+    channel_init(&console->err, stderr);
+    pmx->console = console;
+    register_device(pmx, CONSOLE_FIRST, CONSOLE_FIRST + 1, NULL, console_output);
+    register_device(pmx, CONSOLE_FIRST + 2, CONSOLE_LAST, console_write, NULL);
+    return console;
+}
+
+// Write out what is buffered and free the console
+void
+console_close(PMXConsole *console) {
+    if (console == NULL) return;
+    console_flush(console);
+    free(console);
+}
+
+// Write out both channels, called once per frame
+void
+console_flush(PMXConsole *console) {
+    if (console == NULL) return;
+    channel_flush(&console->out);
+    channel_flush(&console->err);
+}
+
+// Whatever stdin holds right now, up to size bytes, without waiting for more
+static int
+console_read(PMXConsole *console, unsigned char *data, int size) {
+    if (console->input_closed || size <= 0) return 0;
+    long got = 0;
+#ifdef _WIN32
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD waiting = 0;
+    if (_isatty(0)) {
+        while (got < size && _kbhit()) {
+            data[got++] = (unsigned char)_getch();
+        }
+    } else if (PeekNamedPipe(input, NULL, 0, NULL, &waiting, NULL)) {
+        DWORD read = 0;
+        if (waiting > 0 && ReadFile(input, data, waiting < (DWORD)size ? waiting : (DWORD)size, &read, NULL)) {
+            got = read;
+        }
+    } else {
+        console->input_closed = 1;
+    }
+#else
+    struct pollfd fd = { .fd = 0, .events = POLLIN };
+    if (poll(&fd, 1, 0) > 0) {
+        got = read(0, data, size);
+        if (got <= 0) {
+            console->input_closed = 1;
+            got = 0;
+        }
+    }
+#endif
+    return (int)got;
+}
+
+static void
+console_poll(PMXConsole *console) {
+    console->input_next = 0;
+    console->input_count = console_read(console, console->input, CONSOLE_INPUT);
+}
+
+// Move the unread input to the front of the buffer, returns the room behind it
+static int
+console_compact(PMXConsole *console) {
+    int unread = console->input_count - console->input_next;
+    memmove(console->input, console->input + console->input_next, unread);
+    console->input_next = 0;
+    console->input_count = unread;
+    return CONSOLE_INPUT - unread;
+}
+
+/**
+ * @brief Queue input for 0x1E behind what is still unread.
+ *
+ * Bytes that do not fit in CONSOLE_INPUT are dropped.
+ */
+void
+console_feed(PMXConsole *console, const unsigned char *data, int length) {
+    int room = console_compact(console);
+    if (length > room) length = room;
+    memcpy(console->input + console->input_count, data, length);
+    console->input_count += length;
+}
+
+/**
+ * @brief Queue whatever stdin holds right now, without waiting.
+ *
+ * Only as much is read as the buffer has room for, the rest stays in stdin
+ * for the next call.
+ *
+ * @param data Receives a copy of the bytes queued, CONSOLE_INPUT bytes long.
+ * @return The number of bytes queued.
+ */
+int
+console_receive(PMXConsole *console, unsigned char *data) {
+    int got = console_read(console, data, console_compact(console));
+    console_feed(console, data, got);
+    return got;
+}
+
+// The decimal output ports, printed on DVO
+void
+console_output(PMX *pmx, Uint8 port) {
+    PMXConsole *console = pmx->console;
+    char line[16];
+    int length = snprintf(line, sizeof(line), "%d\n", pmx->dev[port]);
+    ConsoleChannel *channel = port == CONSOLE_FIRST ? &console->err : &console->out;
+
+    channel_put(channel, line, length);
+    if (channel->line_flush) channel_flush(channel);
+}
+
+// The text and input ports, acting on the value a DVW just wrote
+void
+console_write(PMX *pmx, Uint8 port) {
+    PMXConsole *console = pmx->console;
+    unsigned int value = pmx->dev[port];
+
+    switch (port) {
+    case 0x1A:
+        channel_put_words(&console->out, pmx, value, -1);
+        break;
+    case 0x1C:
+        channel_put_words(&console->out, pmx, value, (unsigned int)pmx->dev[0x1B]);
+        break;
+    case 0x1D: {
+        char c = (char)(value & 0xFF);
+        channel_put(&console->out, &c, 1);
+        if (c == '\n' && console->out.line_flush) channel_flush(&console->out);
+        break;
+    }
+    case 0x1E: {
+        if (value < (unsigned int)pmx->code_size || value >= (unsigned int)pmx->memory_size) break;
+        if (!console->input_fed && console->input_next == console->input_count) console_poll(console);
+        unsigned int c = CONSOLE_NO_INPUT;
+        if (console->input_next < console->input_count) c = console->input[console->input_next++];
+        memory_fill(pmx, value, c, 1);
+        break;
+    }
+    default:
+        break;
+    }
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include "../pmx.h"
+
+#ifndef PMX_CONSOLE
+#define PMX_CONSOLE
+
+/*
+ * Console ports. Text is one character per word, its low byte.
+ *
+ *   0x18  DVO  print dev[0x18] as a decimal line on stderr
+ *   0x19  DVO  print dev[0x19] as a decimal line on stdout
+ *   0x1A  DVW  print the zero-terminated string at this address on stdout
+ *   0x1B  DVW  set the length 0x1C prints
+ *   0x1C  DVW  print dev[0x1B] words from this address on stdout
+ *   0x1D  DVW  print this character on stdout
+ *   0x1E  DVW  store the next character read from stdin at this address,
+ *              CONSOLE_NO_INPUT when there is none yet, never waits
+ *
+ * When input_fed is set, 0x1E only reads what console_receive() or
+ * console_feed() queued.
+ */
+#define CONSOLE_FIRST 0x18
+#define CONSOLE_LAST 0x1E
+#define CONSOLE_BUFFER 4096   // bytes buffered per output channel
+#define CONSOLE_INPUT 256     // bytes read from stdin at once
+#define CONSOLE_NO_INPUT 0xFFFFFFFFu
+
+typedef struct ConsoleChannel {
+    FILE *file;
+    int line_flush;           // flush at every newline, on when file is a terminal
+    int length;
+    char buffer[CONSOLE_BUFFER];
+} ConsoleChannel;
+
+/**
+ * @brief Buffered console of one PMX.
+ *
+ * Output collects in a buffer per channel and is written when the buffer is
+ * full, at console_flush() (every frame) and, on a terminal, at the end of
+ * each line. Input is read from stdin only once a program asks for it, and
+ * only what is already waiting, or queued by the caller when input_fed is
+ * set.
+ */
+struct PMXConsole {
+    ConsoleChannel out, err;
+    unsigned char input[CONSOLE_INPUT];
+    int input_next, input_count;
+    int input_closed;         // stdin reached its end
+    int input_fed;            // input comes only from console_receive/console_feed
+};
+
+PMXConsole *console_open(PMX *pmx);
+void console_close(PMXConsole *console);
+void console_flush(PMXConsole *console);
+void console_feed(PMXConsole *console, const unsigned char *data, int length);
+int console_receive(PMXConsole *console, unsigned char *data);
+void console_output(PMX *pmx, Uint8 port);
+void console_write(PMX *pmx, Uint8 port);
+
+#endif
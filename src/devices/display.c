@@ -3,11 +3,26 @@
  * @brief Implementation file for the display module.
  *
  * This file contains the implementation of functions related to the display module.
- * The display module is responsible for rendering graphics on the screen using SDL library.
+ * The display module is responsible for rendering graphics into the
+ * framebuffer of a PMXDisplay. Every VM gets its own display through
+ * display_register(), so any number of them can run side by side. Showing the framebuffer is left to a backend:
+ * display_sdl.c presents it in an SDL window, display_memory.c keeps it in
+ * memory for headless runs.
+ *
+ * Drawing keeps track of the rectangles it changed. display_update() only
+ * uploads those to the texture and skips the present when nothing changed.
+ * Redraws from display memory (port 0x12) compare the character records with
+ * the ones drawn last time and only repaint the regions that differ.
+ *
+ * In framebuffer mode there is nothing to draw: the display's pixels point
+ * into VM memory, programs write pixels with STR or the block instructions
+ * and the backend uploads them from there.
  */
 
-#include <SDL.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "../pmx.h"
 #include "./display.h"
 
@@ -81,72 +96,102 @@ const ColorMapping colors_map[COLORS] = {
     {"MAGENTA", 0xf0f}
 };
 
-PMXDisplay pmx_display = {
-    .width = SCREEN_WIDTH,
-    .height = SCREEN_HEIGHT,
-    .pixels = NULL // Initialize with the correct size
-};
-static SDL_Window *window;
-static SDL_Renderer *renderer;
-static SDL_Texture* texture = NULL;
-static SDL_Surface* screenSurface = NULL;
+/*
+ * Rectangle lists: a new rectangle is merged into an existing one when that
+ * costs no more pixels than keeping both, or into the cheapest one once the
+ * list is full. The render thread keeps its slots' lists the same way.
+ */
+static int
+rect_area(DisplayRect r) {
+    return r.w * r.h;
+}
 
-void 
-updateDisplayBg(Uint32 bg) {
-    screenSurface = SDL_GetWindowSurface( window );
-    // SDL_FillRect( screenSurface, NULL, SDL_MapRGB( screenSurface->format, 0x00, 0x00, 0x00 ) );
-    SDL_UpdateWindowSurface( window );
+static DisplayRect
+rect_union(DisplayRect a, DisplayRect b) {
+    int x1 = a.x < b.x ? a.x : b.x;
+    int y1 = a.y < b.y ? a.y : b.y;
+    int x2 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+    int y2 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+    return (DisplayRect){ x1, y1, x2 - x1, y2 - y1 };
 }
 
-void 
-drawPixel(int x, int y, int scale, Uint32 color) {
-    for (int i=1; i <scale+1;i++) {
-        for (int j=0; j <scale;j++) {
-            int x1 = ((x * scale) + (i-1)) * 800;
-            int y1 =  (y * scale) + j;
-            // printf("x: %d\n", x1);
-            // printf("y: %d\n", y1);
-            int c1 = x1+y1;
-            // printf("c1: %d\n", c1);
-            pmx_display.pixels[c1] = color;
+static int
+rect_intersect(DisplayRect a, DisplayRect b, DisplayRect *out) {
+    int x1 = a.x > b.x ? a.x : b.x;
+    int y1 = a.y > b.y ? a.y : b.y;
+    int x2 = a.x + a.w < b.x + b.w ? a.x + a.w : b.x + b.w;
+    int y2 = a.y + a.h < b.y + b.h ? a.y + a.h : b.y + b.h;
+    if (x2 <= x1 || y2 <= y1) return 0;
+    if (out != NULL) *out = (DisplayRect){ x1, y1, x2 - x1, y2 - y1 };
+    return 1;
+}
+
+void
+display_rect_add(const PMXDisplay *display, DisplayRect *list, int *count, DisplayRect r) {
+    DisplayRect screen = { 0, 0, display->width, display->height };
+    if (!rect_intersect(r, screen, &r)) return;
+
+    int best = -1, best_cost = 0;
+    for (int i = 0; i < *count; i++) {
+        int cost = rect_area(rect_union(list[i], r)) - rect_area(list[i]) - rect_area(r);
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
         }
     }
+    if (best >= 0 && (best_cost <= 0 || *count == DISPLAY_DIRTY_MAX)) {
+        list[best] = rect_union(list[best], r);
+    } else {
+        list[(*count)++] = r;
+    }
 }
 
-void 
-drawRect(int x, int y, int width, int height, int scale, Uint32 color) {
-    for (int i = 0; i<width; i++) {
-        for (int j = 0; j<height; j++) {
-            drawPixel(x+i, y+j,scale,color);
-        }
+static void
+markDirty(PMXDisplay *display, DisplayRect r) {
+    display_rect_add(display, display->dirty, &display->dirty_count, r);
+}
+
+void
+display_invalidate(PMXDisplay *display) {
+    display->dirty_count = 0;
+    markDirty(display, (DisplayRect){ 0, 0, display->width, display->height });
+}
+
+/*
+ * Fill a horizontal run of pixels. The loop is a plain store loop so the
+ * compiler turns it into vector stores. Colours whose low and high bytes are
+ * equal, black among them, go through memset.
+ */
+static void
+fillSpan(Uint16 *restrict dst, int length, Uint16 color) {
+    if ((color & 0xFF) == (color >> 8)) {
+        memset(dst, color & 0xFF, length * sizeof(Uint16));
+        return;
+    }
+    for (int i = 0; i < length; i++) {
+        dst[i] = color;
     }
 }
 
+/*
+ * Fill a rectangle of screen pixels, clipped to the current clip rectangle,
+ * one horizontal span per row.
+ */
+static void
+fillRect(PMXDisplay *display, DisplayRect r, Uint16 color) {
+    if (!rect_intersect(r, display->clip, &r)) return;
 
-void 
-drawBitmap(int i, int j, 
-           int index, int width, 
-           const char* bitmap[], 
-           int rows, int cols, 
-           int scale, Uint32 color) 
-{
-    int startX = width * index;
-    int endX = width * (index + 1);
-    
-    for (int y = 0; y < rows; y++) {
-        for (int x = startX; x < endX; x++) {
-            if (bitmap[y][x] == '1') {
-                int newX = y + j;
-                int newY = x - startX + i;
-                drawPixel(newX, newY, scale, color);
-            }
-        }
+    Uint16 *row = display->pixels + r.y * display->width + r.x;
+    for (int y = 0; y < r.h; y++, row += display->width) {
+        fillSpan(row, r.w, color);
     }
 }
 
-void
-drawChar(int index, int x, int y, int scale, Uint32 color) {
-    drawBitmap(x, y, index, 5, alphabet.bitmap, alphabet.height, alphabet.width, scale, color);
+void 
+drawRect(PMXDisplay *display, int x, int y, int width, int height, int scale, Uint32 color) {
+    DisplayRect r = { y * scale, x * scale, height * scale, width * scale };
+    fillRect(display, r, color);
+    markDirty(display, r);
 }
 
 int 
@@ -157,107 +202,381 @@ getAlphabetIndex(char letter) {
     return index;
 }
 
+/*
+ * Glyph atlas: the alphabet bitmap baked at init into the horizontal runs of
+ * lit cells of every glyph, so drawing a character is one span fill per run
+ * and scaled row instead of a string scan and a pixel fill per cell. The atlas
+ * is read-only once baked and shared by every display, the first initDisplay
+ * bakes it.
+ */
+#define GLYPH_COUNT 27
+#define GLYPH_SIZE 5
+#define GLYPH_MAX_SPANS (GLYPH_SIZE * 3) // at most 3 runs in a 5 cell row
+
+typedef struct GlyphSpan {
+    Uint8 row, col, length;
+} GlyphSpan;
+
+static GlyphSpan glyph_spans[GLYPH_COUNT][GLYPH_MAX_SPANS];
+static Uint8 glyph_span_count[GLYPH_COUNT];
+static Sint8 glyph_for_code[0x100]; // display memory character -> glyph, -1 if unknown
+static pthread_once_t glyphs_baked = PTHREAD_ONCE_INIT;
+
+static void
+bakeGlyphs(void) {
+    for (int index = 0; index < GLYPH_COUNT; index++) {
+        int count = 0;
+        for (int row = 0; row < GLYPH_SIZE; row++) {
+            const char *cells = alphabet.bitmap[row] + index * GLYPH_SIZE;
+            for (int col = 0; col < GLYPH_SIZE; col++) {
+                if (cells[col] != '1') continue;
+                int start = col;
+                while (col < GLYPH_SIZE && cells[col] == '1') col++;
+                glyph_spans[index][count++] = (GlyphSpan){ row, start, col - start };
+            }
+        }
+        glyph_span_count[index] = count;
+    }
+
+    memset(glyph_for_code, -1, sizeof(glyph_for_code));
+    for (int i = 0; i < ALPHABET_NUMBER; i++) {
+        char letter = *alphabet_map[i].UpLetter;
+        glyph_for_code[alphabet_map[i].hex] = letter == ' ' ? 0 : getAlphabetIndex(letter) + 1;
+    }
+}
+
 void
-drawString(char string[], int x, int y, int scale, Uint32 color) {
+drawChar(PMXDisplay *display, int index, int x, int y, int scale, Uint32 color) {
+    if (index < 0 || index >= GLYPH_COUNT) return;
+
+    for (int i = 0; i < glyph_span_count[index]; i++) {
+        const GlyphSpan *span = &glyph_spans[index][i];
+        DisplayRect r = { (x + span->col) * scale, (y + span->row) * scale, span->length * scale, scale };
+        fillRect(display, r, color);
+    }
+}
+
+void
+drawString(PMXDisplay *display, char string[], int x, int y, int scale, Uint32 color) {
     int index;
-    for (int i = 0; i < strlen(string);i++) {
+    // Text drawn outside display memory is unknown to the record diffing
+    display->clean = 0;
+    markDirty(display, (DisplayRect){ x * scale, y * scale, 6 * (int)strlen(string) * scale, 5 * scale });
+    for (int i = 0; i < (int)strlen(string);i++) {
         if (string[i] == ' '){
             index = 0;
         }
         else {
             index = getAlphabetIndex(string[i])+1; //+1 because i've assigned 0 to space!
         }
-        drawChar(index, x, y, scale, color);
+        drawChar(display, index, x, y, scale, color);
         x+=6;
     }
 }
 
-void
-initDisplay(int w, int h, Uint32 bg) {
-    pmx_display.width = SCREEN_WIDTH;
-    pmx_display.height = SCREEN_HEIGHT;
-    pmx_display.pixels = (Uint16*)malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint16));
+/**
+ * @brief Set up a display and open its backend.
+ *
+ * The caller owns the PMXDisplay, only the options (frame_prefix,
+ * hash_frames) are kept, the rest of the structure is reset. The screen is
+ * always SCREEN_WIDTH by SCREEN_HEIGHT, filled with the colour bg.
+ *
+ * @return 1 on success, 0 if the framebuffer or the backend failed.
+ */
+int
+initDisplay(PMXDisplay *display, const DisplayBackend *backend, Uint32 bg) {
+    const char *frame_prefix = display->frame_prefix;
+    int hash_frames = display->hash_frames;
+    int threaded = display->threaded;
+    memset(display, 0, sizeof(*display));
+    display->frame_prefix = frame_prefix;
+    display->hash_frames = hash_frames;
+    display->threaded = threaded;
+    display->width = SCREEN_WIDTH;
+    display->height = SCREEN_HEIGHT;
+    display->buffer = (Uint16*)malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint16));
+    if (display->buffer == NULL) return 0;
+    display->pixels = display->buffer;
+    pthread_once(&glyphs_baked, bakeGlyphs);
     
     for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-        pmx_display.pixels[i] = bg;
-        // pmx_display.pixels[i] =0x000;
+        display->pixels[i] = bg;
+        // display->pixels[i] =0x000;
     }
+    display->clip = (DisplayRect){ 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+    display->clean = bg == 0x000;
+    display->record_count = 0;
+    display_invalidate(display);
 
     
-    // drawString("PMX VIRTUAL MACHINE", 0, 0, 5, colors_map[2].hex);
+    // drawString(display, "PMX VIRTUAL MACHINE", 0, 0, 5, colors_map[2].hex);
 
-    // Create a window
-    window = SDL_CreateWindow("PMX Virtual Machine", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, pmx_display.width, pmx_display.height, SDL_WINDOW_SHOWN);
-    if (window == NULL) {
-        fprintf(stderr, "Failed to create window: %s\n", SDL_GetError());
-        SDL_Quit();
+    display->backend = backend;
+    if (!(threaded ? display_thread_start(display) : backend->open(display))) {
+        display->backend = NULL;
+        free(display->buffer);
+        display->pixels = display->buffer = NULL;
+        return 0;
     }
+    return 1;
+}
 
-    // Create a renderer
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (renderer == NULL) {
-        fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-    }
-    
-    updateDisplayBg(bg);
-    
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB444, SDL_TEXTUREACCESS_STREAMING, pmx_display.width, pmx_display.height);
-    if (texture == NULL) {
-        fprintf(stderr, "Unable to create texture: %s\n", SDL_GetError());
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        SDL_Quit();
+void
+closeDisplay(PMXDisplay *display) {
+    if (display->thread != NULL) {
+        display_thread_stop(display);
+        display->backend = NULL;
+    } else if (display->backend != NULL) {
+        display->backend->close(display);
+        display->backend = NULL;
     }
-    
+    free(display->buffer);
+    free(display->records);
+    display->pixels = display->buffer = NULL;
+    display->records = NULL;
+    display->record_count = display->record_capacity = 0;
 }
 
 void 
-display_update() {
-    SDL_UpdateTexture(texture, NULL, pmx_display.pixels, SCREEN_WIDTH * sizeof(Uint16));
-    SDL_RenderClear(renderer);
-    // Clear the renderer, copy the texture, and present the updated frame
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+display_update(PMXDisplay *display) {
+    if (display->dirty_count == 0) return;
+
+    if (display->thread != NULL) {
+        display_thread_publish(display);
+        display->frame++;
+    } else {
+        display->backend->present(display);
+    }
+    display->dirty_count = 0;
+}
+
+/**
+ * @brief Collect the backend's events.
+ *
+ * A threaded display reports what the render thread saw and redraws exposed
+ * windows itself, otherwise the backend is polled here and an exposed window
+ * gets the whole screen presented again.
+ *
+ * @return DISPLAY_EVENT flags.
+ */
+int
+display_poll(PMXDisplay *display) {
+    if (display->thread != NULL) return display_thread_poll(display);
+    if (display->backend->poll == NULL) return 0;
+
+    int events = display->backend->poll(display);
+    if (events & DISPLAY_EXPOSED) display_invalidate(display);
+    return events;
+}
+
+/**
+ * @brief Hash the framebuffer contents.
+ *
+ * 64-bit FNV-1a over the pixels taken 4 at a time, used to compare frames
+ * between builds without storing them.
+ */
+Uint64
+display_hash(const PMXDisplay *display) {
+    const Uint16 *pixels = display->pixels;
+    int count = display->width * display->height;
+    Uint64 hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i + 4 <= count; i += 4) {
+        Uint64 word = (Uint64)pixels[i] | (Uint64)pixels[i + 1] << 16 |
+                      (Uint64)pixels[i + 2] << 32 | (Uint64)pixels[i + 3] << 48;
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Character records in display memory are 5 words: character, x, y, scale,
+ * color. The list ends at the first record holding an unknown character.
+ */
+#define RECORD_WORDS 5
+
+static int
+recordIndex(Uint32 hex) {
+    return hex < 0x100 ? glyph_for_code[hex] : -1;
+}
+
+static DisplayRect
+recordRect(const Uint32 *record) {
+    int scale = record[3];
+    return (DisplayRect){ record[1] * scale, record[2] * scale, 5 * scale, 5 * scale };
+}
+
+static void
+drawRecords(PMXDisplay *display, const Uint32 *records, int count) {
+    for (int i = 0; i < count; i++) {
+        const Uint32 *record = records + i * RECORD_WORDS;
+        if (rect_intersect(recordRect(record), display->clip, NULL)) {
+            drawChar(display, recordIndex(record[0]), record[1], record[2], record[3], record[4]);
+        }
+    }
 }
 
 void 
 drawChar_mem(PMX *pmx) {
-    int addr = DISPLAY_BLOCK;
-    while (addr < DISPLAY_SIZE && pmx->memory[addr] != 0) {
-        char *c = NULL;
-        for (int i = 0; i < ALPHABET_NUMBER; i++) {
-            if (alphabet_map[i].hex == pmx->memory[addr]) {
-                c = alphabet_map[i].UpLetter;
-                break;
+    PMXDisplay *display = pmx->display;
+    int addr = pmx->display_block;
+    int end = pmx->display_block + pmx->display_size;
+    int count = 0;
+    while (addr + RECORD_WORDS <= end && pmx->memory[addr] != 0) {
+        if (recordIndex(pmx->memory[addr]) < 0) break;
+        count++;
+        addr += RECORD_WORDS;
+    }
+
+    const Uint32 *records = pmx->memory + pmx->display_block;
+    DisplayRect screen = { 0, 0, display->width, display->height };
+
+    if (!display->clean) {
+        // Unknown screen contents, clear everything and draw all records
+        display->clip = screen;
+        drawRect(display, 0, 0, 600, 800, 1, 0x000);
+        drawRecords(display, records, count);
+        display->clean = 1;
+    } else {
+        // Repaint the old and new boxes of every record that changed
+        DisplayRect repaint[DISPLAY_DIRTY_MAX];
+        int repaint_count = 0;
+        int total = count > display->record_count ? count : display->record_count;
+        for (int i = 0; i < total; i++) {
+            const Uint32 *old = display->records + i * RECORD_WORDS;
+            const Uint32 *new = records + i * RECORD_WORDS;
+            if (i < count && i < display->record_count &&
+                memcmp(old, new, RECORD_WORDS * sizeof(Uint32)) == 0) {
+                continue;
             }
+            if (i < display->record_count) display_rect_add(display, repaint, &repaint_count, recordRect(old));
+            if (i < count) display_rect_add(display, repaint, &repaint_count, recordRect(new));
+        }
+        for (int i = 0; i < repaint_count; i++) {
+            display->clip = repaint[i];
+            fillRect(display, repaint[i], 0x000);
+            drawRecords(display, records, count);
+            markDirty(display, repaint[i]);
         }
-        
-        if (c == NULL) break;
-
-        int x = pmx->memory[addr+1];
-        int y = pmx->memory[addr+2];
-        int scale = pmx->memory[addr+3];
-        Uint32 color = pmx->memory[addr+4];
-        
-        int index = getAlphabetIndex(*c) + 1;
-        drawChar(index, x, y, scale, color);
-        
-        addr += 5;
+        display->clip = screen;
+    }
+
+    // Remember what is on screen for the next redraw
+    if (count > display->record_capacity) {
+        Uint32 *grown = realloc(display->records, count * RECORD_WORDS * sizeof(Uint32));
+        if (grown == NULL) {
+            display->clean = 0;
+            return;
+        }
+        display->records = grown;
+        display->record_capacity = count;
+    }
+    memcpy(display->records, records, count * RECORD_WORDS * sizeof(Uint32));
+    display->record_count = count;
+}
+
+// Words of display memory a screen mode needs
+static int
+modeWords(const PMXDisplay *display, int mode) {
+    int pixels = display->width * display->height;
+    switch (mode) {
+    case DISPLAY_FRAMEBUFFER: return pixels / 2;
+    case DISPLAY_INDEXED: return DISPLAY_PALETTE + pixels / 4;
+    default: return 0;
+    }
+}
+
+/**
+ * @brief Set the display up for the screen mode in port 0x12.
+ *
+ * Points the pixels at display memory in DISPLAY_FRAMEBUFFER mode and back
+ * at the display's own buffer otherwise. A framebuffer mode that does not
+ * fit in display memory leaves the screen off. Called on every mode change,
+ * every frame (memory moves when a snapshot is restored) and after restores.
+ */
+void
+display_sync(PMX *pmx) {
+    PMXDisplay *display = pmx->display;
+    int mode = (unsigned int)pmx->dev[0x12] <= DISPLAY_INDEXED ? pmx->dev[0x12] : DISPLAY_OFF;
+
+    if (modeWords(display, mode) > pmx->display_size) mode = DISPLAY_OFF;
+    Uint16 *pixels = mode == DISPLAY_FRAMEBUFFER ? (Uint16 *)(pmx->memory + pmx->display_block) : display->buffer;
+    if (mode == display->mode && pixels == display->pixels) return;
+
+    // The screen no longer holds the records drawn last when coming back to them
+    if (display->mode == DISPLAY_FRAMEBUFFER || display->mode == DISPLAY_INDEXED) display->clean = 0;
+    int moved = pixels != display->pixels;
+    display->mode = mode;
+    display->pixels = pixels;
+    if (moved) display_invalidate(display);
+}
+
+// Expand the palette indices into the display's own pixels
+static void
+drawIndexed(PMX *pmx) {
+    PMXDisplay *display = pmx->display;
+    const Uint32 *palette = pmx->memory + pmx->display_block;
+    const Uint32 *words = palette + DISPLAY_PALETTE;
+    int count = display->width * display->height / 4;
+
+    for (int i = 0; i < count; i++) {
+        Uint32 word = words[i];
+        Uint16 *out = display->buffer + i * 4;
+        out[0] = palette[word & 0xFF];
+        out[1] = palette[(word >> 8) & 0xFF];
+        out[2] = palette[(word >> 16) & 0xFF];
+        out[3] = palette[word >> 24];
+    }
+}
+
+// Bring the screen up to date with display memory in the current mode
+static void
+drawMode(PMX *pmx) {
+    switch (pmx->display->mode) {
+    case DISPLAY_RECORDS:
+        drawChar_mem(pmx);
+        break;
+    case DISPLAY_FRAMEBUFFER:
+        display_invalidate(pmx->display);
+        break;
+    case DISPLAY_INDEXED:
+        drawIndexed(pmx);
+        display_invalidate(pmx->display);
+        break;
+    default:
+        break;
     }
 }
 
+/*
+ * Port 0x12 selects the screen mode, 0 turns the screen off. Writing a mode
+ * draws the screen right away, and while the screen is on display_frame()
+ * keeps it in sync with display memory once per frame.
+ */
 void 
 display_deo(PMX *pmx, Uint8 addr) {
-    // printf("dev: %d\n", pmx->dev[addr]);
-    // printf("deo addr: %d\n", pmx->dev[addr]);
     switch (addr)
     {
     case 0x10: break;
     case 0x11: break;
-    case 0x12: drawRect(0, 0, 600, 800, 1, 0x000); drawChar_mem(pmx); break;
+    case 0x12:
+        display_sync(pmx);
+        drawMode(pmx);
+        break;
     default:
         break;
     }
-}
\ No newline at end of file
+}
+
+void
+display_frame(PMX *pmx) {
+    if (pmx->display == NULL) return;
+    display_sync(pmx);
+    drawMode(pmx);
+}
+
+void
+display_register(PMX *pmx, PMXDisplay *display) {
+    pmx->display = display;
+    register_device(pmx, 0x10, 0x17, display_deo, NULL);
+}
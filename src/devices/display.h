@@ -15,16 +15,95 @@ typedef struct ColorMapping {
 } ColorMapping;
 
 
-typedef struct PMXDisplay {
+#define DISPLAY_DIRTY_MAX 8
+
+/*
+ * Screen modes, selected by writing to port 0x12. The framebuffer modes show
+ * display memory as pixels, width * height of them from display_block:
+ *
+ *   DISPLAY_FRAMEBUFFER  RGB444, two pixels per word, the left one in the
+ *                        low 16 bits. The display presents VM memory as is.
+ *   DISPLAY_INDEXED      256 palette words (RGB444) followed by the pixels,
+ *                        four 8-bit indices per word, the left one in the
+ *                        low byte. Converted into the display's own pixels
+ *                        once per frame.
+ */
+enum DISPLAY_MODE {
+    DISPLAY_OFF,
+    DISPLAY_RECORDS,
+    DISPLAY_FRAMEBUFFER,
+    DISPLAY_INDEXED
+};
+
+#define DISPLAY_PALETTE 256
+
+typedef struct DisplayRect {
+    int x, y, w, h;
+} DisplayRect;
+
+// What display_poll reports, or'ed together
+enum DISPLAY_EVENT {
+    DISPLAY_QUIT = 0x1,     // the window was closed
+    DISPLAY_EXPOSED = 0x2   // the window needs to be drawn again
+};
+
+/**
+ * @brief Where the framebuffer goes once a frame is drawn.
+ *
+ * open is called once by initDisplay, present by display_update whenever the
+ * dirty list is not empty, close by closeDisplay. poll, if set, returns the
+ * DISPLAY_EVENT flags seen since the last call. For a threaded display all
+ * four run on the render thread.
+ */
+typedef struct DisplayBackend {
+    const char *name;
+    int (*open)(PMXDisplay *display);
+    void (*present)(PMXDisplay *display);
+    void (*close)(PMXDisplay *display);
+    int (*poll)(PMXDisplay *display);
+} DisplayBackend;
+
+typedef struct DisplayThread DisplayThread;
+
+struct PMXDisplay {
     int width, height, x1, x2, y1, y2, scale;
     Uint32 palette[4];
-    Uint16 *pixels;
+    Uint16 *pixels;                        // the framebuffer presented, buffer or VM memory
+    Uint16 *buffer;                        // the display's own pixels
+    int mode;                              // DISPLAY_MODE the pixels are set up for
     Uint8 *fg, *bg;
-} PMXDisplay;
+    DisplayRect dirty[DISPLAY_DIRTY_MAX];  // changed since the last display_update
+    int dirty_count;
+    DisplayRect clip;                      // drawing is limited to this rectangle
+    int clean;                             // screen holds exactly the records below
+    Uint32 *records;                       // character records drawn last
+    int record_count, record_capacity;
+    const DisplayBackend *backend;
+    const char *frame_prefix;              // memory backend: write frames as PPM
+    int hash_frames;                       // memory backend: print every frame hash
+    int threaded;                          // present from a render thread (display_thread.c)
+    int frame;                             // frames presented (published when threaded) so far
+    void *backend_data;                    // owned by the backend between open and close
+    DisplayThread *thread;                 // the render thread, NULL when not threaded
+};
 
-extern PMXDisplay pmx_display;
-void initDisplay(int w, int h, Uint32 bg);
-void display_update(); 
+extern const DisplayBackend display_sdl_backend;
+extern const DisplayBackend display_memory_backend;
+int initDisplay(PMXDisplay *display, const DisplayBackend *backend, Uint32 bg);
+void closeDisplay(PMXDisplay *display);
+void display_update(PMXDisplay *display); 
+void display_invalidate(PMXDisplay *display);
+void display_rect_add(const PMXDisplay *display, DisplayRect *list, int *count, DisplayRect r);
+int display_poll(PMXDisplay *display);
+Uint64 display_hash(const PMXDisplay *display);
 void display_deo(PMX *pmx, Uint8 addr);
+void display_frame(PMX *pmx);
+void display_sync(PMX *pmx);
+void display_register(PMX *pmx, PMXDisplay *display);
+
+int display_thread_start(PMXDisplay *display);
+void display_thread_publish(PMXDisplay *display);
+int display_thread_poll(PMXDisplay *display);
+void display_thread_stop(PMXDisplay *display);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,68 @@
+/**
+ * @file display_memory.c
+ * @brief In-memory display backend for headless runs.
+ *
+ * Frames stay in the display's pixels. Every present can print the frame
+ * hash and write the frame as a binary PPM. Nothing is shared between
+ * displays, so batch runs can keep one per worker thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "./display.h"
+
+static void
+write_ppm(PMXDisplay *display, const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror("Error opening frame file");
+        return;
+    }
+
+    int count = display->width * display->height;
+    Uint8 *rgb = malloc(count * 3);
+    if (rgb != NULL) {
+        // RGB444 -> 8 bits per channel
+        for (int i = 0; i < count; i++) {
+            Uint16 pixel = display->pixels[i];
+            rgb[i * 3] = ((pixel >> 8) & 0xF) * 17;
+            rgb[i * 3 + 1] = ((pixel >> 4) & 0xF) * 17;
+            rgb[i * 3 + 2] = (pixel & 0xF) * 17;
+        }
+        fprintf(file, "P6\n%d %d\n255\n", display->width, display->height);
+        fwrite(rgb, 3, count, file);
+        free(rgb);
+    }
+    fclose(file);
+}
+
+static int
+memory_open(PMXDisplay *display) {
+    display->frame = 0;
+    return 1;
+}
+
+static void
+memory_present(PMXDisplay *display) {
+    if (display->hash_frames) {
+        printf("frame %d: %016llx\n", display->frame, (unsigned long long)display_hash(display));
+    }
+    if (display->frame_prefix != NULL) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s%05d.ppm", display->frame_prefix, display->frame);
+        write_ppm(display, filename);
+    }
+    display->frame++;
+}
+
+static void
+memory_close(PMXDisplay *display) {
+    (void)display;
+}
+
+const DisplayBackend display_memory_backend = {
+    .name = "memory",
+    .open = memory_open,
+    .present = memory_present,
+    .close = memory_close,
+};
@@ -0,0 +1,117 @@
+/**
+ * @file display_sdl.c
+ * @brief SDL display backend.
+ *
+ * Presents a display framebuffer in a window through a streaming RGB444
+ * texture. Only the dirty rectangles are uploaded on each present. The
+ * window, renderer and texture live in the display's backend_data.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "./display.h"
+
+typedef struct SDLDisplay {
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    SDL_Surface *screenSurface;
+} SDLDisplay;
+
+static void 
+updateDisplayBg(SDLDisplay *sdl) {
+    sdl->screenSurface = SDL_GetWindowSurface( sdl->window );
+    // SDL_FillRect( sdl->screenSurface, NULL, SDL_MapRGB( sdl->screenSurface->format, 0x00, 0x00, 0x00 ) );
+    SDL_UpdateWindowSurface( sdl->window );
+}
+
+static int
+sdl_open(PMXDisplay *display) {
+    SDLDisplay *sdl = calloc(1, sizeof(SDLDisplay));
+    if (sdl == NULL) {
+        fprintf(stderr, "Failed to allocate the SDL display\n");
+        return 0;
+    }
+
+    // Create a window
+    sdl->window = SDL_CreateWindow("PMX Virtual Machine", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, display->width, display->height, SDL_WINDOW_SHOWN);
+    if (sdl->window == NULL) {
+        fprintf(stderr, "Failed to create window: %s\n", SDL_GetError());
+        SDL_Quit();
+        free(sdl);
+        return 0;
+    }
+
+    // Create a renderer
+    sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED);
+    if (sdl->renderer == NULL) {
+        fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+        SDL_DestroyWindow(sdl->window);
+        SDL_Quit();
+        free(sdl);
+        return 0;
+    }
+    
+    updateDisplayBg(sdl);
+    
+    sdl->texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGB444, SDL_TEXTUREACCESS_STREAMING, display->width, display->height);
+    if (sdl->texture == NULL) {
+        fprintf(stderr, "Unable to create texture: %s\n", SDL_GetError());
+        SDL_DestroyRenderer(sdl->renderer);
+        SDL_DestroyWindow(sdl->window);
+        SDL_Quit();
+        free(sdl);
+        return 0;
+    }
+    display->backend_data = sdl;
+    return 1;
+}
+
+static void
+sdl_present(PMXDisplay *display) {
+    SDLDisplay *sdl = display->backend_data;
+    for (int i = 0; i < display->dirty_count; i++) {
+        DisplayRect *r = &display->dirty[i];
+        SDL_Rect rect = { r->x, r->y, r->w, r->h };
+        Uint16 *src = display->pixels + r->y * display->width + r->x;
+        SDL_UpdateTexture(sdl->texture, &rect, src, display->width * sizeof(Uint16));
+    }
+    SDL_RenderClear(sdl->renderer);
+    // Clear the renderer, copy the texture, and present the updated frame
+    SDL_RenderCopy(sdl->renderer, sdl->texture, NULL, NULL);
+    SDL_RenderPresent(sdl->renderer);
+    display->frame++;
+}
+
+static void
+sdl_close(PMXDisplay *display) {
+    SDLDisplay *sdl = display->backend_data;
+    SDL_DestroyTexture(sdl->texture);
+    SDL_DestroyRenderer(sdl->renderer);
+    SDL_DestroyWindow(sdl->window);
+    SDL_Quit();
+    free(sdl);
+    display->backend_data = NULL;
+}
+
+// Window events, on the thread that opened the window
+static int
+sdl_poll(PMXDisplay *display) {
+    SDL_Event e;
+    int events = 0;
+    (void)display;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) events |= DISPLAY_QUIT;
+        if (e.type == SDL_WINDOWEVENT) events |= DISPLAY_EXPOSED;
+    }
+    return events;
+}
+
+const DisplayBackend display_sdl_backend = {
+    .name = "sdl",
+    .open = sdl_open,
+    .present = sdl_present,
+    .close = sdl_close,
+    .poll = sdl_poll,
+};
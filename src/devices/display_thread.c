@@ -0,0 +1,243 @@
+/**
+ * @file display_thread.c
+ * @brief Render thread that presents a display's frames off the VM thread.
+ *
+ * With display->threaded set, initDisplay starts a render thread which owns
+ * the backend: it opens it, pumps its events, presents and closes it, so the
+ * window and renderer live on that thread only. The VM thread never waits
+ * for a present, display_update copies the finished frame into a free slot
+ * of a triple buffer and swaps it in with one atomic exchange.
+ *
+ * Three slots rotate between the VM (back), the handoff (middle) and the
+ * renderer (front). The middle index carries a FRESH bit while it holds a
+ * frame the renderer has not taken yet. Frames published faster than the
+ * renderer presents are skipped, the renderer always shows the newest one.
+ *
+ * Only dirty rectangles move. Each slot remembers where it is behind the
+ * display, so a publish copies just those rectangles, and carries the
+ * rectangles changed since the frame the renderer took before it, which is
+ * all present uploads. A skipped frame hands its rectangles on to the next.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "./display.h"
+
+#define SLOT_COUNT 3
+#define SLOT_FRESH 0x4 // set in middle while it holds an unpresented frame
+#define SLOT_INDEX 0x3
+
+typedef struct FrameSlot {
+    Uint16 *pixels;
+    DisplayRect dirty[DISPLAY_DIRTY_MAX];  // changed since the frame presented before this one
+    int dirty_count;
+} FrameSlot;
+
+struct DisplayThread {
+    pthread_t thread;
+    PMXDisplay view;            // the display as the backend sees it on the render thread
+    FrameSlot slots[SLOT_COUNT];
+    DisplayRect stale[SLOT_COUNT][DISPLAY_DIRTY_MAX];  // VM side: where each slot is behind
+    int stale_count[SLOT_COUNT];
+    unsigned int back;          // slot the VM copies the next frame into
+    unsigned int front;         // slot the renderer presents
+    atomic_uint middle;         // slot handed over, | SLOT_FRESH when not taken yet
+    atomic_int events;          // DISPLAY_EVENT flags not yet read by display_poll
+    atomic_int stop;
+    pthread_mutex_t lock;       // guards opened during startup only
+    pthread_cond_t started;
+    int opened;                 // 0 while opening, 1 once open, -1 if the backend failed
+};
+
+static void
+idle(void) {
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec pause = { 0, 1000000 };
+    nanosleep(&pause, NULL);
+#endif
+}
+
+// Present the front slot, uploading only what changed unless the whole window is needed
+static void
+present(DisplayThread *thread, int whole) {
+    PMXDisplay *view = &thread->view;
+    FrameSlot *slot = &thread->slots[thread->front];
+    view->pixels = slot->pixels;
+    if (whole) {
+        view->dirty[0] = (DisplayRect){ 0, 0, view->width, view->height };
+        view->dirty_count = 1;
+    } else {
+        memcpy(view->dirty, slot->dirty, slot->dirty_count * sizeof(DisplayRect));
+        view->dirty_count = slot->dirty_count;
+    }
+    view->backend->present(view);
+}
+
+// Take the newest frame if there is one, 1 if it was taken
+static int
+take(DisplayThread *thread) {
+    if (!(atomic_load(&thread->middle) & SLOT_FRESH)) return 0;
+    thread->front = atomic_exchange(&thread->middle, thread->front) & SLOT_INDEX;
+    return 1;
+}
+
+static void *
+render(void *arg) {
+    DisplayThread *thread = arg;
+    PMXDisplay *view = &thread->view;
+
+    int ok = view->backend->open(view);
+    pthread_mutex_lock(&thread->lock);
+    thread->opened = ok ? 1 : -1;
+    pthread_cond_signal(&thread->started);
+    pthread_mutex_unlock(&thread->lock);
+    if (!ok) return NULL;
+
+    while (!atomic_load(&thread->stop)) {
+        int events = view->backend->poll != NULL ? view->backend->poll(view) : 0;
+        if (events) atomic_fetch_or(&thread->events, events);
+        int taken = take(thread);
+        if (taken || (events & DISPLAY_EXPOSED)) {
+            present(thread, !taken);
+        } else {
+            idle();
+        }
+    }
+    // The last frame published before the stop is always shown
+    if (take(thread)) present(thread, 0);
+    view->backend->close(view);
+    return NULL;
+}
+
+/**
+ * @brief Start the render thread and open the display's backend on it.
+ *
+ * Waits until the backend is open, that is the only time the VM thread
+ * waits for the renderer.
+ *
+ * @return 1 on success, 0 if the thread or the backend failed.
+ */
+int
+display_thread_start(PMXDisplay *display) {
+    DisplayThread *thread = calloc(1, sizeof(DisplayThread));
+    if (thread == NULL) return 0;
+
+    size_t bytes = (size_t)display->width * display->height * sizeof(Uint16);
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        thread->slots[i].pixels = malloc(bytes);
+        if (thread->slots[i].pixels == NULL) goto fail;
+        memcpy(thread->slots[i].pixels, display->pixels, bytes);
+    }
+    thread->back = 0;
+    atomic_init(&thread->middle, 1);
+    thread->front = 2;
+    atomic_init(&thread->events, 0);
+    atomic_init(&thread->stop, 0);
+    thread->view = *display;
+    thread->view.frame = 0;
+    thread->view.backend_data = NULL;
+    thread->view.pixels = thread->slots[thread->front].pixels;
+
+    pthread_mutex_init(&thread->lock, NULL);
+    pthread_cond_init(&thread->started, NULL);
+    if (pthread_create(&thread->thread, NULL, render, thread) != 0) {
+        pthread_cond_destroy(&thread->started);
+        pthread_mutex_destroy(&thread->lock);
+        goto fail;
+    }
+    pthread_mutex_lock(&thread->lock);
+    while (thread->opened == 0) pthread_cond_wait(&thread->started, &thread->lock);
+    pthread_mutex_unlock(&thread->lock);
+    if (thread->opened < 0) {
+        pthread_join(thread->thread, NULL);
+        pthread_cond_destroy(&thread->started);
+        pthread_mutex_destroy(&thread->lock);
+        goto fail;
+    }
+    display->thread = thread;
+    return 1;
+
+fail:
+    for (int i = 0; i < SLOT_COUNT; i++) free(thread->slots[i].pixels);
+    free(thread);
+    return 0;
+}
+
+static void
+copy_rect(const PMXDisplay *display, Uint16 *to, DisplayRect r) {
+    for (int y = r.y; y < r.y + r.h; y++) {
+        size_t at = (size_t)y * display->width + r.x;
+        memcpy(to + at, display->pixels + at, r.w * sizeof(Uint16));
+    }
+}
+
+/**
+ * @brief Hand the current frame to the renderer.
+ *
+ * Brings the back slot up to date with the display's dirty rectangles and
+ * swaps it with the middle one, never blocks. A middle frame the renderer
+ * has not taken is pulled back first, its rectangles go to the new frame.
+ */
+void
+display_thread_publish(PMXDisplay *display) {
+    DisplayThread *thread = display->thread;
+    unsigned int back = thread->back;
+    FrameSlot *slot = &thread->slots[back];
+
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        for (int j = 0; j < display->dirty_count; j++) {
+            display_rect_add(display, thread->stale[i], &thread->stale_count[i], display->dirty[j]);
+        }
+    }
+    for (int j = 0; j < thread->stale_count[back]; j++) {
+        copy_rect(display, slot->pixels, thread->stale[back][j]);
+    }
+    thread->stale_count[back] = 0;
+
+    memcpy(slot->dirty, display->dirty, display->dirty_count * sizeof(DisplayRect));
+    slot->dirty_count = display->dirty_count;
+    // Once its FRESH bit is cleared the renderer cannot take the middle slot, it is ours to read
+    unsigned int middle = atomic_load(&thread->middle);
+    if ((middle & SLOT_FRESH) &&
+        atomic_compare_exchange_strong(&thread->middle, &middle, middle & SLOT_INDEX)) {
+        const FrameSlot *skipped = &thread->slots[middle & SLOT_INDEX];
+        for (int j = 0; j < skipped->dirty_count; j++) {
+            display_rect_add(display, slot->dirty, &slot->dirty_count, skipped->dirty[j]);
+        }
+    }
+    thread->back = atomic_exchange(&thread->middle, back | SLOT_FRESH) & SLOT_INDEX;
+}
+
+// DISPLAY_EVENT flags the renderer saw since the last call
+int
+display_thread_poll(PMXDisplay *display) {
+    return atomic_exchange(&display->thread->events, 0);
+}
+
+/**
+ * @brief Present the last published frame, close the backend and join.
+ */
+void
+display_thread_stop(PMXDisplay *display) {
+    DisplayThread *thread = display->thread;
+    if (thread == NULL) return;
+
+    atomic_store(&thread->stop, 1);
+    pthread_join(thread->thread, NULL);
+    pthread_cond_destroy(&thread->started);
+    pthread_mutex_destroy(&thread->lock);
+    for (int i = 0; i < SLOT_COUNT; i++) free(thread->slots[i].pixels);
+    free(thread);
+    display->thread = NULL;
+}
@@ -0,0 +1,483 @@
+/**
+ * @file execute.h
+ * @brief The interpreter loop, included by pmx.c once per variant.
+ *
+ * Before each inclusion pmx.c defines
+ *
+ *   EXECUTE  the name of the function
+ *   CHECKED  1 for the checked interpreter, which checks stack depth, memory
+ *            addresses and register operands and stops the machine on the
+ *            first bad one; 0 for the unchecked interpreter that runs
+ *            programs verify_program() accepted, with the checks compiled out
+ *
+ * The dispatch, budget, check and stack macros it uses are defined in pmx.c.
+ * Handlers reach the top of the work stack through TOP and change the depth
+ * only through PUSH, DROP and REDUCE, so the top can stay cached in tos.
+ */
+
+static long
+EXECUTE(PMX *pmx, long budget, int *running) {
+    unsigned int *mem = pmx->memory;
+    unsigned int *wst = pmx->wst;
+    unsigned int *rst = pmx->rst;
+    int *reg = pmx->registers;
+    PMXInsn *code = pmx->code;
+    unsigned int code_size = pmx->code_size;
+    unsigned int memory_size = pmx->memory_size;
+    int wst_size = pmx->wst_size;
+    int rst_size = pmx->rst_size;
+    PMXTrace *trace = pmx->trace;
+#ifdef PMX_PROFILER
+    PMXProfile *profile = pmx->profile;
+#endif
+#ifdef PMX_JIT
+    // Compiled blocks have no checks either
+    PMXJit *jit = !CHECKED && trace == NULL && pmx->profile == NULL ? pmx->jit : NULL;
+#endif
+    int pc = pmx->pc;
+    int sp = pmx->sp;
+    int rp = pmx->rp;
+#if TOS_CACHE
+    unsigned int tos;
+    FILL();
+#endif
+    const PMXInsn *insn;
+    PMXInsn scratch;
+    unsigned int op;
+    long count = 0;
+
+#if PMX_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static const void *table[OPCODE_TABLE_SIZE] = {
+        [0 ... OPCODE_TABLE_SIZE - 1] = &&op_unknown,
+        PMX_OPCODES(TABLE_ENTRY)
+    };
+    static const void *fused_table[FUSED_COUNT] = { PMX_FUSED(FUSED_ENTRY) };
+#pragma GCC diagnostic pop
+#endif
+
+    if (budget <= 0) return 0;
+    DISPATCH();
+
+#if !PMX_THREADED
+dispatch:
+    FETCH();
+    switch (insn->fused) {
+        PMX_FUSED(FUSED_CASE)
+        default: break;
+    }
+    switch (op) {
+        PMX_OPCODES(CASE_ENTRY)
+        default: goto op_unknown;
+    }
+#endif
+
+op_halt:
+    SYNC();
+    halt(pmx, *running);
+    RELOAD();
+    *running = 0;
+    PROFILE();
+    TRACE();
+    return count + 1;
+
+op_load:
+    reg[op - 1] = insn->arg[0];
+    pc += 2;
+    NEXT();
+
+op_add:
+    STACK(2, 1);
+    REDUCE(2, TOP + wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_sub:
+    STACK(2, 1);
+    REDUCE(2, TOP - wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_push: {
+    unsigned int r = insn->arg[0] - 1;
+    if (r < REGISTER_NUMBER) {
+        STACK(0, 1);
+        PUSH(reg[r]);
+    }
+    pc += 2;
+    NEXT();
+}
+
+op_pop: {
+    unsigned int r = insn->arg[0] - 1;
+    if (r < REGISTER_NUMBER) {
+        STACK(1, 0);
+        reg[r] = TOP;
+        DROP(1);
+    }
+    pc += 2;
+    NEXT();
+}
+
+op_equal:
+    STACK(2, 1);
+    REDUCE(2, (TOP == wst[sp - 1]) ? 0 : 1);
+    pc += 1;
+    NEXT();
+
+op_gth:
+    STACK(2, 1);
+    REDUCE(2, ((int)TOP > (int)wst[sp - 1]) ? 0 : 1);
+    pc += 1;
+    NEXT();
+
+op_lth:
+    STACK(2, 1);
+    REDUCE(2, ((int)TOP < (int)wst[sp - 1]) ? 0 : 1);
+    pc += 1;
+    NEXT();
+
+op_dup:
+    STACK(1, 2);
+    PUSH(TOP);
+    pc += 1;
+    NEXT();
+
+op_pot:
+    STACK(0, 1);
+    PUSH(insn->arg[0]);
+    pc += 2;
+    NEXT();
+
+op_ovr:
+    STACK(2, 3);
+    PUSH(wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_inc:
+    STACK(1, 1);
+    TOP++;
+    pc += 1;
+    NEXT();
+
+op_dcr:
+    STACK(1, 1);
+    TOP--;
+    pc += 1;
+    NEXT();
+
+op_mov: {
+    // flags select register (0) or memory (1) for the source and destination
+    unsigned int src = insn->arg[2];
+    unsigned int dst = insn->arg[3];
+    CHECK(insn->arg[0] == 0 ? src - 1 < REGISTER_NUMBER : src < memory_size);
+    CHECK(insn->arg[1] == 0 ? dst - 1 < REGISTER_NUMBER : dst < memory_size);
+    unsigned int value = insn->arg[0] == 0 ? (unsigned int)reg[src - 1] : mem[src];
+    if (insn->arg[1] == 0) {
+        reg[dst - 1] = value;
+    } else {
+        if (trace) trace_mem(trace, dst, value);
+        INVALIDATE(dst);
+        mem[dst] = value;
+    }
+    pc += 5;
+    NEXT();
+}
+
+op_mul:
+    STACK(2, 1);
+    REDUCE(2, TOP * wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_div:
+    STACK(2, 1);
+    REDUCE(2, (unsigned int)int_div((int)TOP, (int)wst[sp - 1]));
+    pc += 1;
+    NEXT();
+
+op_mod:
+    STACK(2, 1);
+    REDUCE(2, (unsigned int)int_mod((int)TOP, (int)wst[sp - 1]));
+    pc += 1;
+    NEXT();
+
+op_and:
+    STACK(2, 1);
+    REDUCE(2, TOP & wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_or:
+    STACK(2, 1);
+    REDUCE(2, TOP | wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_xor:
+    STACK(2, 1);
+    REDUCE(2, TOP ^ wst[sp - 1]);
+    pc += 1;
+    NEXT();
+
+op_shl:
+    STACK(2, 1);
+    REDUCE(2, TOP << (wst[sp - 1] & 31));
+    pc += 1;
+    NEXT();
+
+op_shr:
+    STACK(2, 1);
+    REDUCE(2, TOP >> (wst[sp - 1] & 31));
+    pc += 1;
+    NEXT();
+
+op_pow:
+    STACK(2, 1);
+    REDUCE(2, int_pow((int)TOP, (int)wst[sp - 1]));
+    pc += 1;
+    NEXT();
+
+op_sqrt:
+    STACK(1, 1);
+    TOP = int_sqrt((int)TOP);
+    pc += 1;
+    NEXT();
+
+op_abs:
+    STACK(1, 1);
+    TOP = abs((int)TOP);
+    pc += 1;
+    NEXT();
+
+op_str:
+    STACK(2, 0);
+    CHECK(TOP < memory_size);
+    if (trace) trace_mem(trace, TOP, wst[sp - 1]);
+    INVALIDATE(TOP);
+    mem[TOP] = wst[sp - 1];
+    DROP(2);
+    pc += 1;
+    NEXT();
+
+op_copy: {
+    STACK(3, 0);
+    unsigned int dst = TOP, src = wst[sp - 1], n = wst[sp - 2];
+    DROP(3);
+    memory_copy(pmx, dst, src, n);
+    pc += 1;
+    NEXT();
+}
+
+op_fill: {
+    STACK(3, 0);
+    unsigned int dst = TOP, value = wst[sp - 1], n = wst[sp - 2];
+    DROP(3);
+    memory_fill(pmx, dst, value, n);
+    pc += 1;
+    NEXT();
+}
+
+op_cmp:
+    STACK(3, 1);
+    REDUCE(3, memory_compare(pmx, TOP, wst[sp - 1], wst[sp - 2]));
+    pc += 1;
+    NEXT();
+
+op_vadd: {
+    STACK(3, 0);
+    unsigned int dst = TOP, src = wst[sp - 1], n = wst[sp - 2];
+    DROP(3);
+    memory_add(pmx, dst, src, n);
+    pc += 1;
+    NEXT();
+}
+
+op_vscale: {
+    STACK(3, 0);
+    unsigned int dst = TOP, factor = wst[sp - 1], n = wst[sp - 2];
+    DROP(3);
+    memory_scale(pmx, dst, factor, n);
+    pc += 1;
+    NEXT();
+}
+
+op_vdot:
+    STACK(3, 1);
+    REDUCE(3, memory_dot(pmx, TOP, wst[sp - 1], wst[sp - 2]));
+    pc += 1;
+    NEXT();
+
+op_dvo: {
+    Uint8 port = insn->arg[0];
+    pc += 2;
+    PROFILE_PORT(port_outputs);
+    if (pmx->ports[port].output != NULL) {
+        SYNC();
+        PROFILE_TIME(pmx, port_seconds[port], pmx->ports[port].output(pmx, port));
+        RELOAD();
+    }
+    NEXT();
+}
+
+op_dvw: {
+    Uint8 port = insn->arg[0];
+    STACK(1, 0);
+    pmx->dev[port] = TOP;
+    DROP(1);
+    pc += 2;
+    PROFILE_PORT(port_writes);
+    if (pmx->ports[port].write != NULL) {
+        SYNC();
+        PROFILE_TIME(pmx, port_seconds[port], pmx->ports[port].write(pmx, port));
+        RELOAD();
+    }
+    NEXT();
+}
+
+op_goto: {
+    STACK(1, 2);
+    unsigned int target = TOP;
+    PUSH(pc + 1);
+    pc = target;
+    NEXT_JUMP();
+}
+
+op_jmp:
+    STACK(1, 0);
+    pc = TOP;
+    DROP(1);
+    NEXT_JUMP();
+
+op_rmv:
+    STACK(1, 0);
+    DROP(1);
+    pc += 1;
+    NEXT();
+
+op_jnz: {
+    STACK(1, 0);
+    unsigned int taken = TOP;
+    DROP(1);
+    if (taken != 0) {
+        STACK(1, 0);
+        pc = TOP;
+        DROP(1);
+    } else {
+        pc += 1;
+    }
+    NEXT_JUMP();
+}
+
+op_rpc:
+    STACK(0, 1);
+    PUSH(pc);
+    pc += 1;
+    NEXT();
+
+op_ret:
+    STACK(1, 0);
+    CHECK(rp + 1 < rst_size);
+    rst[++rp] = TOP;
+    DROP(1);
+    pc += 1;
+    NEXT();
+
+op_swap: {
+    STACK(2, 0);
+    CHECK((unsigned int)TOP - 1 < REGISTER_NUMBER && (unsigned int)wst[sp - 1] - 1 < REGISTER_NUMBER);
+    int r1 = TOP;
+    int r2 = wst[sp - 1];
+    DROP(2);
+    int temp = reg[r1 - 1];
+    reg[r1 - 1] = reg[r2 - 1];
+    reg[r2 - 1] = temp;
+    pc += 3;
+    NEXT();
+}
+
+fuse_store_const: {
+    if (UNFUSED(3)) goto op_pot;
+    unsigned int value = insn->arg[0];
+    unsigned int addr = insn[2].arg[0];
+    STACK(0, 2);
+    CHECK(addr < memory_size);
+    INVALIDATE(addr);
+    mem[addr] = value;
+    pc += 5;
+    count += 2;
+    NEXT();
+}
+
+fuse_call: {
+    if (UNFUSED(2)) goto op_pot;
+    STACK(0, 2);
+    unsigned int target = insn->arg[0];
+    PUSH(target);
+    PUSH(pc + 3);
+    pc = target;
+    count += 1;
+    NEXT_JUMP();
+}
+
+fuse_pot_jnz:
+    if (UNFUSED(2)) goto op_pot;
+    STACK(0, 1);
+    if (insn->arg[0] != 0) {
+        STACK(1, 0);
+        pc = TOP;
+        DROP(1);
+    } else {
+        pc += 3;
+    }
+    count += 1;
+    NEXT_JUMP();
+
+fuse_dup_case:
+    // JNZ jumps to the duplicated value itself when it differs
+    if (UNFUSED(4)) goto op_dup;
+    STACK(1, 3);
+    if (TOP != insn[1].arg[0]) {
+        pc = TOP;
+        DROP(1);
+    } else {
+        pc += 5;
+    }
+    count += 3;
+    NEXT_JUMP();
+
+fuse_inc_reg:
+    if (UNFUSED(3)) goto op_push;
+    STACK(0, 1);
+    reg[insn[3].arg[0] - 1] = (unsigned int)reg[insn->arg[0] - 1] + 1;
+    pc += 5;
+    count += 2;
+    NEXT();
+
+fuse_dcr_reg:
+    if (UNFUSED(3)) goto op_push;
+    STACK(0, 1);
+    reg[insn[3].arg[0] - 1] = (unsigned int)reg[insn->arg[0] - 1] - 1;
+    pc += 5;
+    count += 2;
+    NEXT();
+
+fault:
+    // Only the checked interpreter gets here, the machine stops like on an unknown opcode
+    *running = 0;
+    SYNC();
+    return count;
+
+op_unknown:
+    *running = 0;
+    TRACE();
+    SYNC();
+    return count;
+
+out:
+    SYNC();
+    return count;
+}
@@ -0,0 +1,664 @@
+/**
+ * @file jit.c
+ * @brief Optional x86-64 tier that compiles hot basic blocks to native code.
+ *
+ * The interpreter counts jumps to every pc inside the program. Once a target
+ * has been jumped to JIT_THRESHOLD times, the straight-line run of
+ * instructions starting there is translated, one machine code template per
+ * instruction, into a block of x86-64 code. Blocks are entered from jumps in
+ * the interpreter and chain into each other through a table of entry points,
+ * so a hot loop runs without returning to C at all.
+ *
+ * Inside a block pc is a constant and sp is kept in a host register, stack
+ * slots are addressed relative to it with offsets known at compile time, so
+ * sp is only moved once per block exit. Device I/O (DVW, DVO), HALT, POW,
+ * SQRT, SWAP, unknown opcodes and MOV with operands the interpreter does not
+ * bounds-check end the block: the block exits and the interpreter executes
+ * that instruction itself. A STR whose address falls inside the program or
+ * outside memory takes the same side exit, so the interpreter invalidates the
+ * predecoded code and the blocks covering the address before the store.
+ *
+ * Every block checks at its entry that all of it fits in the instruction
+ * budget of the run() or step_n() call, so both execute exactly the same
+ * number of instructions as the interpreter does.
+ *
+ * Needs an x86-64 host and a build with -DPMX_JIT (make JIT=1), otherwise
+ * jit_open() refuses to start. Tracing and profiling bypass the JIT.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "./jit.h"
+
+#if defined(PMX_JIT) && (defined(__x86_64__) || defined(_M_X64))
+#define JIT_NATIVE 1
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#else
+#define JIT_NATIVE 0
+#endif
+
+/*
+ * Machine state shared with the native code, which keeps wst, memory, the
+ * registers and sp in rbx-relative host registers while it runs and writes
+ * sp, pc and the instruction count back here when it leaves.
+ */
+typedef struct JitState {
+    unsigned int *wst;
+    unsigned int *memory;
+    int *registers;
+    unsigned int *rst;
+    void **entry;       // native entry point per pc, NULL when not compiled
+    long long count;    // instructions executed so far
+    long long limit;    // a block is only entered when all of it fits
+    long long sp;
+    int rp;
+    int pc;
+} JitState;
+
+typedef void (*JitEnter)(JitState *state, void *entry);
+
+typedef struct JitBlock {
+    unsigned int start;
+    unsigned int end;   // first word after the block's last instruction
+} JitBlock;
+
+struct PMXJit {
+    Uint8 *buffer;      // JIT_CODE_SIZE bytes of executable memory
+    size_t used;
+    size_t base;        // end of the shared entry and exit code
+    size_t exit;        // offset of the shared exit code
+    JitEnter enter;
+    void **entry;       // code_size entries
+    Uint16 *heat;       // jumps seen per pc, JIT_THRESHOLD once compiled or given up
+    unsigned int code_size;
+    JitBlock *blocks;
+    int block_count;
+    int block_capacity;
+};
+
+#if !JIT_NATIVE
+
+PMXJit *
+jit_open(PMX *pmx) {
+    (void)pmx;
+#ifdef PMX_JIT
+    fprintf(stderr, "The JIT needs an x86-64 host\n");
+#else
+    fprintf(stderr, "The JIT needs a build with -DPMX_JIT\n");
+#endif
+    return NULL;
+}
+
+void jit_close(PMXJit *jit) { (void)jit; }
+void jit_reset(PMXJit *jit, int code_size) { (void)jit; (void)code_size; }
+void jit_invalidate(PMXJit *jit, unsigned int addr) { (void)jit; (void)addr; }
+int jit_ready(PMXJit *jit, PMX *pmx, unsigned int pc) { (void)jit; (void)pmx; (void)pc; return 0; }
+long jit_run(PMX *pmx, long budget) { (void)pmx; (void)budget; return 0; }
+
+#else
+
+// Host registers: rbx holds the JitState, r12 wst, r13 memory, r14 registers, r15 sp
+enum { EAX = 0, ECX = 1, EDX = 2 };
+
+#define STATE(field) ((Sint32)offsetof(JitState, field))
+
+// Worst case bytes per instruction template and per exit, used to reserve space
+#define JIT_INSN_BYTES 48
+#define JIT_EXIT_BYTES 64
+
+static void
+emit8(PMXJit *jit, Uint8 byte) {
+    jit->buffer[jit->used++] = byte;
+}
+
+static void
+emit32(PMXJit *jit, Uint32 value) {
+    memcpy(jit->buffer + jit->used, &value, 4);
+    jit->used += 4;
+}
+
+static void
+emit_bytes(PMXJit *jit, const char *bytes, int length) {
+    memcpy(jit->buffer + jit->used, bytes, length);
+    jit->used += length;
+}
+
+// Emit a jump or jcc whose rel32 is patched later, returns where the rel32 is
+static size_t
+emit_branch(PMXJit *jit, const char *opcode, int length) {
+    emit_bytes(jit, opcode, length);
+    size_t site = jit->used;
+    emit32(jit, 0);
+    return site;
+}
+
+static void
+patch(PMXJit *jit, size_t site, size_t target) {
+    Sint32 rel = (Sint32)(target - (site + 4));
+    memcpy(jit->buffer + site, &rel, 4);
+}
+
+// op reg, [r12 + r15 * 4 + slot * 4], a working stack slot relative to sp
+static void
+emit_wst(PMXJit *jit, Uint8 opcode, int reg, int slot) {
+    emit8(jit, 0x43);
+    emit8(jit, opcode);
+    emit8(jit, 0x84 | reg << 3);
+    emit8(jit, 0xBC);
+    emit32(jit, slot * 4);
+}
+
+// op reg, [r14 + index * 4], a VM register
+static void
+emit_reg(PMXJit *jit, Uint8 opcode, int reg, unsigned int index) {
+    emit8(jit, 0x41);
+    emit8(jit, opcode);
+    emit8(jit, 0x86 | reg << 3);
+    emit32(jit, index * 4);
+}
+
+// op reg, [r13 + addr * 4], a memory word at a constant address
+static void
+emit_mem(PMXJit *jit, Uint8 opcode, int reg, unsigned int addr) {
+    emit8(jit, 0x41);
+    emit8(jit, opcode);
+    emit8(jit, 0x85 | reg << 3);
+    emit32(jit, addr * 4);
+}
+
+// op reg, [rbx + offset], a JitState field, rex is 0 for none
+static void
+emit_state(PMXJit *jit, Uint8 rex, Uint8 opcode, int reg, Sint32 offset) {
+    if (rex) emit8(jit, rex);
+    emit8(jit, opcode);
+    emit8(jit, 0x83 | (reg & 7) << 3);
+    emit32(jit, offset);
+}
+
+/*
+ * Shared code at the start of the buffer. The entry saves the callee-saved
+ * registers, loads the machine state and jumps to the block, the exit stores
+ * sp back and returns to jit_run().
+ */
+static void
+emit_shared(PMXJit *jit) {
+    emit_bytes(jit, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);  // push rbx, r12-r15
+#ifdef _WIN32
+    emit_bytes(jit, "\x48\x89\xCB", 3);                           // mov rbx, rcx
+#else
+    emit_bytes(jit, "\x48\x89\xFB", 3);                           // mov rbx, rdi
+#endif
+    emit_state(jit, 0x4C, 0x8B, 4, STATE(wst));                   // mov r12, [rbx + wst]
+    emit_state(jit, 0x4C, 0x8B, 5, STATE(memory));                // mov r13, [rbx + memory]
+    emit_state(jit, 0x4C, 0x8B, 6, STATE(registers));             // mov r14, [rbx + registers]
+    emit_state(jit, 0x4C, 0x8B, 7, STATE(sp));                    // mov r15, [rbx + sp]
+#ifdef _WIN32
+    emit_bytes(jit, "\xFF\xE2", 2);                               // jmp rdx
+#else
+    emit_bytes(jit, "\xFF\xE6", 2);                               // jmp rsi
+#endif
+
+    jit->exit = jit->used;
+    emit_state(jit, 0x4C, 0x89, 7, STATE(sp));                    // mov [rbx + sp], r15
+    emit_bytes(jit, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\xC3", 10);  // pop r15-r12, rbx; ret
+    jit->base = jit->used;
+}
+
+// Leave the block at a known pc after executed instructions, sp moved by depth
+static void
+emit_exit(PMXJit *jit, int depth, unsigned int pc, int executed) {
+    if (depth != 0) {
+        emit_bytes(jit, "\x49\x81\xC7", 3);                       // add r15, depth
+        emit32(jit, depth);
+    }
+    emit_state(jit, 0, 0xC7, 0, STATE(pc));                       // mov dword [rbx + pc], pc
+    emit32(jit, pc);
+    if (executed != 0) {
+        emit_state(jit, 0x48, 0x81, 0, STATE(count));             // add qword [rbx + count], executed
+        emit32(jit, executed);
+    }
+    patch(jit, emit_branch(jit, "\xE9", 1), jit->exit);           // jmp exit
+}
+
+// Continue at the pc in eax: straight into its block if it has one, else leave
+static void
+emit_chain(PMXJit *jit, int depth, int executed) {
+    if (depth != 0) {
+        emit_bytes(jit, "\x49\x81\xC7", 3);                       // add r15, depth
+        emit32(jit, depth);
+    }
+    emit_state(jit, 0, 0x89, EAX, STATE(pc));                     // mov [rbx + pc], eax
+    emit_state(jit, 0x48, 0x81, 0, STATE(count));                 // add qword [rbx + count], executed
+    emit32(jit, executed);
+    emit8(jit, 0x3D);                                             // cmp eax, code_size
+    emit32(jit, jit->code_size);
+    patch(jit, emit_branch(jit, "\x0F\x83", 2), jit->exit);       // jae exit
+    emit_state(jit, 0x48, 0x8B, EDX, STATE(entry));               // mov rdx, [rbx + entry]
+    emit_bytes(jit, "\x48\x8B\x14\xC2", 4);                       // mov rdx, [rdx + rax * 8]
+    emit_bytes(jit, "\x48\x85\xD2", 3);                           // test rdx, rdx
+    patch(jit, emit_branch(jit, "\x0F\x84", 2), jit->exit);       // jz exit
+    emit_bytes(jit, "\xFF\xE2", 2);                               // jmp rdx
+}
+
+typedef struct JitInsn {
+    unsigned int pc;
+    unsigned int op;
+    unsigned int length;
+    unsigned int arg[PMX_INSN_MAX - 1];
+} JitInsn;
+
+// Instruction lengths, 0 for the ones the JIT leaves to the interpreter
+static unsigned int
+jit_length(unsigned int op) {
+    if (op >= 0x01 && op <= 0x08) return 2;
+    switch (op) {
+    case 0x0B: case 0x0C: case 0x11:
+        return 2;
+    case 0x20:
+        return 5;
+    case 0x09: case 0x0A: case 0x0D: case 0x0E: case 0x0F: case 0x10: case 0x12:
+    case 0x13: case 0x14: case 0x25: case 0xAA: case 0xDE: case 0xDF: case 0xEE:
+    case 0xEF: case 0xFE: case 0xFF:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * MOV is compiled when its register operands are valid and its memory
+ * operands are constant addresses inside memory, a destination inside the
+ * program is left to the interpreter so the store invalidates the code.
+ */
+static int
+jit_mov_supported(const PMX *pmx, unsigned int code_size, const JitInsn *insn) {
+    unsigned int src = insn->arg[2], dst = insn->arg[3];
+    unsigned int memory_size = pmx->memory_size < 0x20000000 ? pmx->memory_size : 0x20000000;
+    int src_ok = insn->arg[0] == 0 ? src - 1 < REGISTER_NUMBER : src < memory_size;
+    int dst_ok = insn->arg[1] == 0 ? dst - 1 < REGISTER_NUMBER : dst >= code_size && dst < memory_size;
+    return src_ok && dst_ok;
+}
+
+static void
+emit_mov(PMXJit *jit, const JitInsn *insn) {
+    unsigned int src = insn->arg[2], dst = insn->arg[3];
+    if (insn->arg[0] == 0) {
+        emit_reg(jit, 0x8B, EAX, src - 1);
+    } else {
+        emit_mem(jit, 0x8B, EAX, src);
+    }
+    if (insn->arg[1] == 0) {
+        emit_reg(jit, 0x89, EAX, dst - 1);
+    } else {
+        emit_mem(jit, 0x89, EAX, dst);
+    }
+}
+
+// Compare the top two slots into the lower one, setcc is the condition giving 1
+static void
+emit_compare(PMXJit *jit, int depth, Uint8 setcc) {
+    emit_wst(jit, 0x8B, EAX, depth);                              // mov eax, top
+    emit_bytes(jit, "\x31\xC9", 2);                               // xor ecx, ecx
+    emit_wst(jit, 0x3B, EAX, depth - 1);                          // cmp eax, second
+    emit8(jit, 0x0F);
+    emit8(jit, setcc);                                            // setcc cl
+    emit8(jit, 0xC1);
+    emit_wst(jit, 0x89, ECX, depth - 1);                          // mov second, ecx
+}
+
+static void
+jit_flush(PMXJit *jit) {
+    jit->used = jit->base;
+    jit->block_count = 0;
+    if (jit->code_size > 0) {
+        memset(jit->entry, 0, jit->code_size * sizeof(void *));
+        memset(jit->heat, 0, jit->code_size * sizeof(Uint16));
+    }
+}
+
+static int
+jit_add_block(PMXJit *jit, unsigned int start, unsigned int end) {
+    if (jit->block_count == jit->block_capacity) {
+        int capacity = jit->block_capacity ? jit->block_capacity * 2 : 64;
+        JitBlock *grown = realloc(jit->blocks, capacity * sizeof(JitBlock));
+        if (grown == NULL) return 0;
+        jit->blocks = grown;
+        jit->block_capacity = capacity;
+    }
+    jit->blocks[jit->block_count++] = (JitBlock){ start, end };
+    return 1;
+}
+
+/*
+ * Translate the block starting at start. The block runs until a jump, an
+ * instruction left to the interpreter or JIT_BLOCK_MAX instructions, and
+ * never past the end of the program.
+ */
+static int
+jit_compile(PMXJit *jit, PMX *pmx, unsigned int start) {
+    const unsigned int *mem = pmx->memory;
+    unsigned int code_size = jit->code_size;
+    JitInsn insns[JIT_BLOCK_MAX];
+    int count = 0;
+    int ends = 0;
+    unsigned int at = start;
+
+    while (count < JIT_BLOCK_MAX && at < code_size) {
+        JitInsn *insn = &insns[count];
+        insn->pc = at;
+        insn->op = mem[at];
+        insn->length = jit_length(insn->op);
+        if (insn->length == 0 || at + insn->length > code_size) break;
+        for (unsigned int i = 1; i < insn->length; i++) {
+            insn->arg[i - 1] = mem[at + i];
+        }
+        if (insn->op == 0x20 && !jit_mov_supported(pmx, code_size, insn)) break;
+        count++;
+        at += insn->length;
+        if (insn->op == 0xDE || insn->op == 0xDF || insn->op == 0xEF) {
+            ends = 1;
+            break;
+        }
+    }
+    if (count == 0) return 0;
+
+    size_t worst = (size_t)count * (JIT_INSN_BYTES + JIT_EXIT_BYTES) + 2 * JIT_EXIT_BYTES;
+    if (jit->used + worst > JIT_CODE_SIZE) jit_flush(jit);
+
+    size_t head = jit->used;
+    size_t exits[JIT_BLOCK_MAX];    // rel32 of the side exit in front of insns[i], 0 if none
+    int depths[JIT_BLOCK_MAX];
+    int depth = 0;
+
+    // Enter only when the whole block fits in what is left of the budget
+    emit_state(jit, 0x48, 0x8B, EAX, STATE(count));               // mov rax, [rbx + count]
+    emit_bytes(jit, "\x48\x05", 2);                               // add rax, count
+    emit32(jit, count);
+    emit_state(jit, 0x48, 0x3B, EAX, STATE(limit));               // cmp rax, [rbx + limit]
+    size_t over_budget = emit_branch(jit, "\x0F\x8F", 2);         // jg over_budget
+
+    for (int i = 0; i < count; i++) {
+        const JitInsn *insn = &insns[i];
+        unsigned int op = insn->op;
+        exits[i] = 0;
+        depths[i] = depth;
+
+        if (op >= 0x01 && op <= 0x08) {
+            emit_reg(jit, 0xC7, 0, op - 1);                       // mov dword reg, value
+            emit32(jit, insn->arg[0]);
+            continue;
+        }
+        switch (op) {
+        case 0x09:  // ADD
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_wst(jit, 0x01, EAX, depth - 1);
+            depth--;
+            break;
+        case 0x0A:  // SUB
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_wst(jit, 0x2B, EAX, depth - 1);
+            emit_wst(jit, 0x89, EAX, depth - 1);
+            depth--;
+            break;
+        case 0x0B:  // PUSH
+            if (insn->arg[0] - 1 < REGISTER_NUMBER) {
+                emit_reg(jit, 0x8B, EAX, insn->arg[0] - 1);
+                emit_wst(jit, 0x89, EAX, depth + 1);
+                depth++;
+            }
+            break;
+        case 0x0C:  // POP
+            if (insn->arg[0] - 1 < REGISTER_NUMBER) {
+                emit_wst(jit, 0x8B, EAX, depth);
+                emit_reg(jit, 0x89, EAX, insn->arg[0] - 1);
+                depth--;
+            }
+            break;
+        case 0x0D:  // EQUAL, 0 when equal
+            emit_compare(jit, depth, 0x95);                       // setne
+            depth--;
+            break;
+        case 0x0E:  // GTH, 0 when top > second
+            emit_compare(jit, depth, 0x9E);                       // setle
+            depth--;
+            break;
+        case 0x0F:  // LTH, 0 when top < second
+            emit_compare(jit, depth, 0x9D);                       // setge
+            depth--;
+            break;
+        case 0x10:  // DUP
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_wst(jit, 0x89, EAX, depth + 1);
+            depth++;
+            break;
+        case 0x11:  // POT
+            emit_wst(jit, 0xC7, 0, depth + 1);
+            emit32(jit, insn->arg[0]);
+            depth++;
+            break;
+        case 0x12:  // OVR
+            emit_wst(jit, 0x8B, EAX, depth - 1);
+            emit_wst(jit, 0x89, EAX, depth + 1);
+            depth++;
+            break;
+        case 0x13:  // INC
+            emit_wst(jit, 0x83, 0, depth);
+            emit8(jit, 1);
+            break;
+        case 0x14:  // DCR
+            emit_wst(jit, 0x83, 5, depth);
+            emit8(jit, 1);
+            break;
+        case 0x20:  // MOV
+            emit_mov(jit, insn);
+            break;
+        case 0x25:  // ABS
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_bytes(jit, "\x89\xC1\xF7\xD9\x0F\x48\xC8", 7);   // mov ecx, eax; neg ecx; cmovs ecx, eax
+            emit_wst(jit, 0x89, ECX, depth);
+            break;
+        case 0xAA:  // STR, stores into the program or outside memory go to the interpreter
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_bytes(jit, "\x8D\x88", 2);                       // lea ecx, [rax - code_size]
+            emit32(jit, -code_size);
+            emit_bytes(jit, "\x81\xF9", 2);                       // cmp ecx, memory_size - code_size
+            emit32(jit, pmx->memory_size - code_size);
+            exits[i] = emit_branch(jit, "\x0F\x83", 2);           // jae side exit
+            emit_wst(jit, 0x8B, ECX, depth - 1);
+            emit_bytes(jit, "\x41\x89\x4C\x85\x00", 5);           // mov [r13 + rax * 4], ecx
+            depth -= 2;
+            break;
+        case 0xEE:  // RMV
+            depth--;
+            break;
+        case 0xFE:  // RPC
+            emit_wst(jit, 0xC7, 0, depth + 1);
+            emit32(jit, insn->pc);
+            depth++;
+            break;
+        case 0xFF:  // RET
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_state(jit, 0, 0x8B, ECX, STATE(rp));             // mov ecx, [rbx + rp]
+            emit_bytes(jit, "\x83\xC1\x01", 3);                   // add ecx, 1
+            emit_state(jit, 0, 0x89, ECX, STATE(rp));             // mov [rbx + rp], ecx
+            emit_state(jit, 0x48, 0x8B, EDX, STATE(rst));         // mov rdx, [rbx + rst]
+            emit_bytes(jit, "\x48\x63\xC9\x89\x04\x8A", 6);       // movsxd rcx, ecx; mov [rdx + rcx * 4], eax
+            depth--;
+            break;
+        case 0xDE:  // GOTO leaves the target and pushes the return address
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_wst(jit, 0xC7, 0, depth + 1);
+            emit32(jit, insn->pc + 1);
+            emit_chain(jit, depth + 1, count);
+            break;
+        case 0xDF:  // JMP
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_chain(jit, depth - 1, count);
+            break;
+        case 0xEF: {  // JNZ pops the target only when it jumps
+            emit_wst(jit, 0x8B, EAX, depth);
+            emit_bytes(jit, "\x85\xC0", 2);                       // test eax, eax
+            size_t not_taken = emit_branch(jit, "\x0F\x84", 2);   // jz not_taken
+            emit_wst(jit, 0x8B, EAX, depth - 1);
+            emit_chain(jit, depth - 2, count);
+            patch(jit, not_taken, jit->used);
+            emit8(jit, 0xB8);                                     // mov eax, pc + 1
+            emit32(jit, insn->pc + 1);
+            emit_chain(jit, depth - 1, count);
+            break;
+        }
+        }
+    }
+
+    if (!ends) {
+        if (count == JIT_BLOCK_MAX) {
+            // Cut for length only, the next block may well be compiled
+            emit8(jit, 0xB8);                                     // mov eax, at
+            emit32(jit, at);
+            emit_chain(jit, depth, count);
+        } else {
+            emit_exit(jit, depth, at, count);
+        }
+    }
+
+    // Side exits run nothing of their instruction, the interpreter takes over there
+    for (int i = 0; i < count; i++) {
+        if (exits[i] == 0) continue;
+        patch(jit, exits[i], jit->used);
+        emit_exit(jit, depths[i], insns[i].pc, i);
+    }
+    patch(jit, over_budget, jit->used);
+    emit_exit(jit, 0, start, 0);
+
+    if (!jit_add_block(jit, start, at)) {
+        jit->used = head;
+        return 0;
+    }
+    jit->entry[start] = jit->buffer + head;
+    return 1;
+}
+
+/**
+ * @brief Attach the JIT to a PMX.
+ *
+ * @return The JIT, NULL if this build or host has no JIT or allocation failed.
+ */
+PMXJit *
+jit_open(PMX *pmx) {
+    PMXJit *jit = calloc(1, sizeof(PMXJit));
+    if (jit == NULL) return NULL;
+#ifdef _WIN32
+    jit->buffer = VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    jit->buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) jit->buffer = NULL;
+#endif
+    if (jit->buffer == NULL) {
+        fprintf(stderr, "Error: cannot allocate executable memory for the JIT\n");
+        free(jit);
+        return NULL;
+    }
+    emit_shared(jit);
+    Uint8 *enter = jit->buffer;
+    memcpy(&jit->enter, &enter, sizeof(jit->enter));
+    jit_reset(jit, pmx->code_size);
+    pmx->jit = jit;
+    return jit;
+}
+
+void
+jit_close(PMXJit *jit) {
+    if (jit == NULL) return;
+#ifdef _WIN32
+    VirtualFree(jit->buffer, 0, MEM_RELEASE);
+#else
+    munmap(jit->buffer, JIT_CODE_SIZE);
+#endif
+    free(jit->entry);
+    free(jit->heat);
+    free(jit->blocks);
+    free(jit);
+}
+
+/**
+ * @brief Drop every compiled block, called when a program is (un)loaded.
+ */
+void
+jit_reset(PMXJit *jit, int code_size) {
+    free(jit->entry);
+    free(jit->heat);
+    jit->entry = code_size > 0 ? calloc(code_size, sizeof(void *)) : NULL;
+    jit->heat = code_size > 0 ? calloc(code_size, sizeof(Uint16)) : NULL;
+    if (jit->entry == NULL || jit->heat == NULL) {
+        free(jit->entry);
+        free(jit->heat);
+        jit->entry = NULL;
+        jit->heat = NULL;
+        code_size = 0;
+    }
+    jit->code_size = code_size;
+    jit_flush(jit);
+}
+
+/**
+ * @brief Drop the blocks covering addr, called before a store into the program.
+ */
+void
+jit_invalidate(PMXJit *jit, unsigned int addr) {
+    for (int i = 0; i < jit->block_count; i++) {
+        JitBlock *block = &jit->blocks[i];
+        if (addr < block->start || addr >= block->end) continue;
+        jit->entry[block->start] = NULL;
+        jit->heat[block->start] = 0;
+        jit->blocks[i--] = jit->blocks[--jit->block_count];
+    }
+}
+
+/**
+ * @brief Count a jump to pc, compiling its block when it gets hot.
+ *
+ * @return 1 if jit_run() can start at pc.
+ */
+int
+jit_ready(PMXJit *jit, PMX *pmx, unsigned int pc) {
+    if (pc >= jit->code_size) return 0;
+    if (jit->entry[pc] != NULL) return 1;
+    if (jit->heat[pc] >= JIT_THRESHOLD || ++jit->heat[pc] < JIT_THRESHOLD) return 0;
+    return jit_compile(jit, pmx, pc);
+}
+
+/**
+ * @brief Run compiled blocks from pmx->pc until one exits to the interpreter.
+ *
+ * @param budget Most instructions to execute.
+ * @return Instructions executed, pc, sp and rp are written back to the PMX.
+ */
+long
+jit_run(PMX *pmx, long budget) {
+    PMXJit *jit = pmx->jit;
+    JitState state = {
+        .wst = pmx->wst,
+        .memory = pmx->memory,
+        .registers = pmx->registers,
+        .rst = pmx->rst,
+        .entry = jit->entry,
+        .count = 0,
+        .limit = budget,
+        .sp = pmx->sp,
+        .rp = pmx->rp,
+        .pc = pmx->pc,
+    };
+    jit->enter(&state, jit->entry[pmx->pc]);
+    pmx->sp = (int)state.sp;
+    pmx->rp = state.rp;
+    pmx->pc = state.pc;
+    return (long)state.count;
+}
+
+#endif
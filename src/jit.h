@@ -0,0 +1,17 @@
+#include "./pmx.h"
+
+#ifndef PMX_JIT_H
+#define PMX_JIT_H
+
+#define JIT_THRESHOLD 16           // jumps to a pc before the block there is compiled
+#define JIT_BLOCK_MAX 256          // instructions per compiled block
+#define JIT_CODE_SIZE (4 << 20)    // bytes of native code, everything is flushed when full
+
+PMXJit *jit_open(PMX *pmx);
+void jit_close(PMXJit *jit);
+void jit_reset(PMXJit *jit, int code_size);
+void jit_invalidate(PMXJit *jit, unsigned int addr);
+int jit_ready(PMXJit *jit, PMX *pmx, unsigned int pc);
+long jit_run(PMX *pmx, long budget);
+
+#endif
@@ -19,33 +19,74 @@
  * The opcode mappings are defined in the opcode_map array, which maps each opcode to its corresponding assembly instruction.
  * 
  * The functions in this file are designed to be used in conjunction with other modules of the PMX system,
- * such as the display module for console output and the device module for I/O operations.
+ * such as the display module and the device module for I/O operations. Console
+ * output and input live in devices/console.c.
  * 
- * Note: Some functions in this file have TODO comments indicating that they should be moved to separate modules.
- * These functions are currently included in this file for simplicity.
+ * Execution tracing is off by default, see trace.c for the recorder that
+ * replaced the old per-instruction dump to log.txt.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <limits.h>
 #include "pmx.h"
 #include "./devices/display.h"
+#include "./devices/console.h"
+#include "./trace.h"
+#include "./profile.h"
+#include "./jit.h"
+#include "./verify.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-void 
-init_pmx(PMX *pmx) {
+const PMXConfig pmx_default_config = {
+    .memory_size = MEMORY_SIZE,
+    .wst_size = MEMORY_SIZE,
+    .rst_size = MEMORY_SIZE,
+    .display_block = DISPLAY_BLOCK,
+    .display_size = DISPLAY_SIZE,
+};
+
+/**
+ * @brief Initialize a PMX with the given memory layout.
+ *
+ * Memory and stacks come from calloc, which hands out fresh zero pages for
+ * large blocks, so the parts a program never touches are never committed.
+ *
+ * @return 1 on success, 0 if the layout is invalid or allocation failed.
+ */
+int
+init_pmx_config(PMX *pmx, const PMXConfig *config) {
     if (pmx == NULL) {
         fprintf(stderr, "Error: PMX pointer is NULL\n");
-        return;
+        return 0;
     }
-    pmx->memory = malloc(MEMORY_SIZE * sizeof(unsigned int));
-    pmx->wst = malloc(MEMORY_SIZE * sizeof(unsigned int));
-    pmx->rst = malloc(MEMORY_SIZE * sizeof(unsigned int));
-    pmx->step = 0;
-    for (int i = 0; i < MEMORY_SIZE; i++) {
-        pmx->memory[i] = 0;
-        pmx->wst[i] = 0;
-        pmx->rst[i] = 0;
+    if (config->memory_size <= 0 || config->wst_size <= 0 || config->rst_size <= 0 ||
+        config->display_block < 0 || config->display_size < 0 ||
+        config->display_block > config->memory_size - config->display_size) {
+        fprintf(stderr, "Error: invalid PMX memory layout\n");
+        return 0;
+    }
+    pmx->memory = calloc(config->memory_size, sizeof(unsigned int));
+    pmx->wst = calloc(config->wst_size, sizeof(unsigned int));
+    pmx->rst = calloc(config->rst_size, sizeof(unsigned int));
+    if (pmx->memory == NULL || pmx->wst == NULL || pmx->rst == NULL) {
+        fprintf(stderr, "Error: failed to allocate PMX memory\n");
+        free(pmx->memory);
+        free(pmx->wst);
+        free(pmx->rst);
+        return 0;
     }
+    pmx->memory_size = config->memory_size;
+    pmx->wst_size = config->wst_size;
+    pmx->rst_size = config->rst_size;
+    pmx->display_block = config->display_block;
+    pmx->display_size = config->display_size;
+    pmx->step = 0;
+    pmx->steps = 0;
     
     for (int i = 0; i < REGISTER_NUMBER; i++) {
         pmx->registers[i] = 0;
@@ -54,14 +95,58 @@ init_pmx(PMX *pmx) {
     pmx->rp = -1;
     pmx->pc = 0;
     pmx->time = 0;
+    pmx->trace = NULL;
+    pmx->display = NULL;
+    pmx->profile = NULL;
+    pmx->jit = NULL;
+    pmx->console = NULL;
+    pmx->native = NULL;
+    pmx->code = NULL;
+    pmx->code_size = 0;
+    pmx->verified = 0;
+    for (int i = 0; i < 0x100; i++) {
+        pmx->dev[i] = 0;
+    }
+    register_device(pmx, 0x00, 0xFF, NULL, NULL);
+    if (console_open(pmx) == NULL) {
+        fprintf(stderr, "Error: failed to allocate the console\n");
+        free_pmx(pmx);
+        return 0;
+    }
+    return 1;
 }
 
 void 
+init_pmx(PMX *pmx) {
+    init_pmx_config(pmx, &pmx_default_config);
+}
+
+void
+free_pmx(PMX *pmx) {
+    free(pmx->memory);
+    free(pmx->wst);
+    free(pmx->rst);
+    free(pmx->code);
+    console_close(pmx->console);
+    pmx->console = NULL;
+    pmx->memory = pmx->wst = pmx->rst = NULL;
+    pmx->code = NULL;
+    pmx->code_size = 0;
+}
+
+// Copy a program to address 0, 0 without loading it when memory is too small
+int
 load_program(PMX *pmx, int *program, int length) {
+    if (length < 0 || length > pmx->memory_size) {
+        fprintf(stderr, "Program of %d words does not fit in %d words of memory\n", length, pmx->memory_size);
+        return 0;
+    }
     pmx->steps = length;
     for (int i = 0; i < length; i++) {
         pmx->memory[i] = program[i];
     }
+    predecode_reset(pmx, length);
+    return 1;
 }
 
 void
@@ -71,11 +156,13 @@ unload_program(PMX *pmx) {
     pmx->rp = -1;
 
     // Clear the program memory
+    if (pmx->trace) trace_fill(pmx->trace, 0, pmx->registers[7], 0);
     for (int i = 0; i < pmx->registers[7]; i++) {
         pmx->memory[i] = 0;
     }
     
     pmx->registers[7] = 0;
+    predecode_reset(pmx, 0);
 }
 
 
@@ -194,17 +281,6 @@ swap(PMX *pmx) {
 }
 
 
-// TODO: Move to console.c
-void 
-console_deo(PMX *pmx, int addr) {
-    if (addr == 24) {
-        fprintf(stderr, "%d\n", pmx->dev[addr]);
-    } else if (addr == 25) {
-        printf("%d\n", pmx->dev[addr]);
-    }
-    pmx->pc += 2;
-}
-
 void 
 increase(PMX *pmx) {
     pmx->wst[pmx->sp]++;
@@ -223,11 +299,35 @@ remove_top_of_stack(PMX *pmx) {
     pmx->pc += 1;
 }
 
-// TODO: Move to console.c
+/*
+ * Device bus: devices register handlers for a range of ports once, DVW
+ * stores into dev[] and calls the port's write handler right away, DVO
+ * calls its output handler.
+ */
+void
+register_device(PMX *pmx, int first, int last, PMXDeviceHandler write, PMXDeviceHandler output) {
+    for (int port = first; port <= last && port < 0x100; port++) {
+        pmx->ports[port].write = write;
+        pmx->ports[port].output = output;
+    }
+}
+
+void
+device_write(PMX *pmx, Uint8 port, unsigned int value) {
+    pmx->dev[port] = value;
+    if (pmx->ports[port].write != NULL) pmx->ports[port].write(pmx, port);
+}
+
+void
+device_output(PMX *pmx, Uint8 port) {
+    if (pmx->ports[port].output != NULL) pmx->ports[port].output(pmx, port);
+}
+
 void 
 dev_write(PMX *pmx, int addr) {
-    pmx->dev[addr] = pmx->wst[pmx->sp--];
+    unsigned int value = pmx->wst[pmx->sp--];
     pmx->pc += 2;
+    device_write(pmx, addr, value);
 }
 
 void 
@@ -247,18 +347,72 @@ goto_instruction(PMX *pmx) {
     jump(pmx);
 }
 
+/*
+ * Integer arithmetic. Everything wraps modulo 2^32 like ADD and SUB, and no
+ * operand makes the VM trap:
+ *
+ *   x / 0 is 0, x % 0 is x, INT_MIN / -1 is INT_MIN and INT_MIN % -1 is 0
+ *   POW with a negative exponent truncates 1 / base^-exponent toward zero
+ *   SQRT is the floor of the square root, 0 for negative values
+ */
+int
+int_div(int a, int b) {
+    if (b == 0) return 0;
+    if (b == -1) return (int)(0u - (unsigned int)a);
+    return a / b;
+}
+
+int
+int_mod(int a, int b) {
+    if (b == 0) return a;
+    if (b == -1) return 0;
+    return a % b;
+}
+
+int
+int_pow(int base, int exponent) {
+    if (exponent < 0) {
+        if (base == 1) return 1;
+        if (base == -1) return exponent & 1 ? -1 : 1;
+        return 0;
+    }
+    unsigned int result = 1, factor = (unsigned int)base;
+    for (unsigned int e = (unsigned int)exponent; e != 0; e >>= 1) {
+        if (e & 1) result *= factor;
+        factor *= factor;
+    }
+    return (int)result;
+}
+
+int
+int_sqrt(int value) {
+    if (value <= 0) return 0;
+    unsigned int rest = (unsigned int)value, root = 0;
+    unsigned int bit = 1u << 30;
+    while (bit > rest) bit >>= 2;
+    for (; bit != 0; bit >>= 2) {
+        if (rest >= root + bit) {
+            rest -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return (int)root;
+}
+
 void 
 power(PMX *pmx) {
     int value = pmx->wst[pmx->sp--];
     int power = pmx->wst[pmx->sp--];
-    pmx->wst[++pmx->sp] = (int)pow(value, power);
+    pmx->wst[++pmx->sp] = int_pow(value, power);
     pmx->pc += 1;
 }
 
 void 
 sqrt_instruction(PMX *pmx) {
     int value = pmx->wst[pmx->sp--];
-    pmx->wst[++pmx->sp] = (int)sqrt(value);
+    pmx->wst[++pmx->sp] = int_sqrt(value);
     pmx->pc += 1;
 }
 
@@ -273,44 +427,279 @@ void
 store(PMX *pmx) {
     unsigned int addr = pmx->wst[pmx->sp--];
     int value = pmx->wst[pmx->sp--];
+    if (pmx->trace) trace_mem(pmx->trace, addr, value);
+    predecode_invalidate(pmx, addr);
     pmx->memory[addr] = value;
     // printf("in mem: %d | addr: %d\n", pmx->memory[addr], addr);
     pmx->pc += 1;
 }
 
+/*
+ * Bulk memory: COPY, FILL and CMP work on ranges of count words, with the
+ * operands on the stack (top first). A range reaching past the end of memory
+ * is cut short there. Writes into the program reset the predecoded code like
+ * STR does, so block copies can patch code too.
+ *
+ *   COPY  dst src count  memmove semantics, overlapping ranges are fine
+ *   FILL  dst value count
+ *   CMP   a b count      pushes 0 when the ranges are equal, like EQUAL
+ *
+ * The vector instructions apply integer arithmetic elementwise, wrapping
+ * like ADD. Ranges are cut short the same way, to the shorter of the two.
+ *
+ *   VADD    dst src count     dst[i] += src[i], in increasing i
+ *   VSCALE  dst factor count  dst[i] *= factor
+ *   VDOT    a b count         pushes the sum of a[i] * b[i]
+ */
+static unsigned int
+memory_range(const PMX *pmx, unsigned int addr, unsigned int count) {
+    unsigned int size = pmx->memory_size;
+    if (addr >= size) return 0;
+    return count < size - addr ? count : size - addr;
+}
+
+static void
+memory_written(PMX *pmx, unsigned int addr, unsigned int count) {
+    unsigned int end = addr + count < (unsigned int)pmx->code_size ? addr + count : (unsigned int)pmx->code_size;
+    for (unsigned int i = addr; i < end; i++) {
+        predecode_invalidate(pmx, i);
+    }
+}
+
+// memmove and memcmp are vectorized by the C library, the fill is done here
+static void
+fill_words(unsigned int *dst, unsigned int value, unsigned int count) {
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        _mm_storeu_si128((__m128i *)(dst + i + 4), v);
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = value;
+    }
+}
+
+/*
+ * Kernels of the vector instructions, 8 words per step with AVX2, 4 with
+ * SSE2 and one at a time otherwise. Integer adds and multiplies wrap the
+ * same in every lane, so all three give the same results.
+ */
+#if defined(__SSE2__) && !defined(__AVX2__)
+// _mm_mullo_epi32 is SSE4.1, SSE2 multiplies the even and odd lanes apart
+static inline __m128i
+mullo_words(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+static void
+add_words(unsigned int *dst, const unsigned int *src, unsigned int count) {
+    unsigned int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(a, b));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(a, b));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] += src[i];
+    }
+}
+
+static void
+scale_words(unsigned int *dst, unsigned int factor, unsigned int count) {
+    unsigned int i = 0;
+#if defined(__AVX2__)
+    __m256i f = _mm256_set1_epi32((int)factor);
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_mullo_epi32(a, f));
+    }
+#elif defined(__SSE2__)
+    __m128i f = _mm_set1_epi32((int)factor);
+    for (; i + 4 <= count; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), mullo_words(a, f));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] *= factor;
+    }
+}
+
+static unsigned int
+dot_words(const unsigned int *a, const unsigned int *b, unsigned int count) {
+    unsigned int i = 0, sum = 0;
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(x, y));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = (unsigned int)_mm_cvtsi128_si32(half);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi32(acc, mullo_words(x, y));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = (unsigned int)_mm_cvtsi128_si32(acc);
+#endif
+    for (; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
 void
-mov(PMX *pmx) {
-    int flag1 = pmx->memory[++pmx->pc];
-    int flag2 = pmx->memory[++pmx->pc];
-    int arg1 = pmx->memory[++pmx->pc];
-    int arg2 = pmx->memory[++pmx->pc];
-    printf("%d,%d,%d,%d\n",flag1,flag2,arg1,arg2);
-    if (flag1 == 0) {
-        if (flag2 == 0) {
-            pmx->registers[arg2-1] = pmx->registers[arg1-1];
+memory_copy(PMX *pmx, unsigned int dst, unsigned int src, unsigned int count) {
+    count = memory_range(pmx, dst, memory_range(pmx, src, count));
+    if (count == 0) return;
+    memory_written(pmx, dst, count);
+    memmove(pmx->memory + dst, pmx->memory + src, count * sizeof(unsigned int));
+    if (pmx->trace) {
+        for (unsigned int i = 0; i < count; i++) {
+            trace_mem(pmx->trace, dst + i, pmx->memory[dst + i]);
         }
-        else {
-            pmx->memory[arg2] = pmx->registers[arg1-1];
+    }
+}
+
+void
+memory_fill(PMX *pmx, unsigned int dst, unsigned int value, unsigned int count) {
+    count = memory_range(pmx, dst, count);
+    if (count == 0) return;
+    if (pmx->trace) trace_fill(pmx->trace, dst, count, value);
+    memory_written(pmx, dst, count);
+    fill_words(pmx->memory + dst, value, count);
+}
+
+int
+memory_compare(const PMX *pmx, unsigned int a, unsigned int b, unsigned int count) {
+    unsigned int in_a = memory_range(pmx, a, count), in_b = memory_range(pmx, b, count);
+    if (in_a != in_b) return 1;
+    return memcmp(pmx->memory + a, pmx->memory + b, in_a * sizeof(unsigned int)) != 0;
+}
+
+void
+memory_add(PMX *pmx, unsigned int dst, unsigned int src, unsigned int count) {
+    count = memory_range(pmx, dst, memory_range(pmx, src, count));
+    if (count == 0) return;
+    memory_written(pmx, dst, count);
+    unsigned int *words = pmx->memory;
+    if (dst > src && dst - src < count) {
+        // src runs into dst ahead of it, later words must see the earlier sums
+        for (unsigned int i = 0; i < count; i++) {
+            words[dst + i] += words[src + i];
         }
+    } else {
+        add_words(words + dst, words + src, count);
     }
-    else {
-        if (flag2 == 0) {
-            pmx->registers[arg2-1] = pmx->memory[arg1];
+    if (pmx->trace) {
+        for (unsigned int i = 0; i < count; i++) {
+            trace_mem(pmx->trace, dst + i, words[dst + i]);
         }
-        else {
-            pmx->memory[arg2] = pmx->memory[arg1];
+    }
+}
+
+void
+memory_scale(PMX *pmx, unsigned int dst, unsigned int factor, unsigned int count) {
+    count = memory_range(pmx, dst, count);
+    if (count == 0) return;
+    memory_written(pmx, dst, count);
+    scale_words(pmx->memory + dst, factor, count);
+    if (pmx->trace) {
+        for (unsigned int i = 0; i < count; i++) {
+            trace_mem(pmx->trace, dst + i, pmx->memory[dst + i]);
         }
     }
-    pmx->pc++; 
 }
 
+unsigned int
+memory_dot(const PMX *pmx, unsigned int a, unsigned int b, unsigned int count) {
+    count = memory_range(pmx, a, memory_range(pmx, b, count));
+    return dot_words(pmx->memory + a, pmx->memory + b, count);
+}
+
+void
+block_copy(PMX *pmx) {
+    unsigned int dst = pmx->wst[pmx->sp--];
+    unsigned int src = pmx->wst[pmx->sp--];
+    unsigned int count = pmx->wst[pmx->sp--];
+    memory_copy(pmx, dst, src, count);
+    pmx->pc += 1;
+}
+
+void
+block_fill(PMX *pmx) {
+    unsigned int dst = pmx->wst[pmx->sp--];
+    unsigned int value = pmx->wst[pmx->sp--];
+    unsigned int count = pmx->wst[pmx->sp--];
+    memory_fill(pmx, dst, value, count);
+    pmx->pc += 1;
+}
+
+void
+block_compare(PMX *pmx) {
+    unsigned int a = pmx->wst[pmx->sp--];
+    unsigned int b = pmx->wst[pmx->sp--];
+    unsigned int count = pmx->wst[pmx->sp--];
+    pmx->wst[++pmx->sp] = memory_compare(pmx, a, b, count);
+    pmx->pc += 1;
+}
+
+void
+block_add(PMX *pmx) {
+    unsigned int dst = pmx->wst[pmx->sp--];
+    unsigned int src = pmx->wst[pmx->sp--];
+    unsigned int count = pmx->wst[pmx->sp--];
+    memory_add(pmx, dst, src, count);
+    pmx->pc += 1;
+}
+
+void
+block_scale(PMX *pmx) {
+    unsigned int dst = pmx->wst[pmx->sp--];
+    unsigned int factor = pmx->wst[pmx->sp--];
+    unsigned int count = pmx->wst[pmx->sp--];
+    memory_scale(pmx, dst, factor, count);
+    pmx->pc += 1;
+}
+
+void
+block_dot(PMX *pmx) {
+    unsigned int a = pmx->wst[pmx->sp--];
+    unsigned int b = pmx->wst[pmx->sp--];
+    unsigned int count = pmx->wst[pmx->sp--];
+    pmx->wst[++pmx->sp] = memory_dot(pmx, a, b, count);
+    pmx->pc += 1;
+}
 
 typedef struct {
     unsigned char opcode;
     const char *assembly;
 } OpcodeMapping;
 
-#define OPCODE_COUNT 32 // Number of opcodes
+#define OPCODE_COUNT 49 // Number of opcodes
 
 // Array of opcode mappings
 const OpcodeMapping opcode_map[OPCODE_COUNT] = {
@@ -335,7 +724,24 @@ const OpcodeMapping opcode_map[OPCODE_COUNT] = {
     {0x12, "OVR"},
     {0x13, "INC"},
     {0x14, "DCR"},
+    {0x15, "MUL"},
+    {0x16, "DIV"},
+    {0x17, "MOD"},
+    {0x18, "AND"},
+    {0x19, "OR"},
+    {0x1A, "XOR"},
+    {0x1B, "SHL"},
+    {0x1C, "SHR"},
     {0x20, "MOV"},
+    {0x23, "POW"},
+    {0x24, "SQRT"},
+    {0x25, "ABS"},
+    {0x30, "COPY"},
+    {0x31, "FILL"},
+    {0x32, "CMP"},
+    {0x33, "VADD"},
+    {0x34, "VSCALE"},
+    {0x35, "VDOT"},
     {0xAA, "STR"},
     {0xAF, "DVO"},
     {0xBF, "DVW"},
@@ -357,183 +763,414 @@ get_assembly_instruction(unsigned char opcode) {
     return "UNKNOWN"; // Return "UNKNOWN" if opcode is not found
 }
 void 
-dump(PMX *pmx, int opcode) {
-    // Open the file in write mode
-    FILE *file = fopen("./log.txt", "a");
-    if (file == NULL) {
-        // Handle file open error
-        perror("Error opening file");
-        return;
+ret(PMX *pmx) {
+    pmx->rst[++pmx->rp] = pmx->wst[pmx->sp--];
+    pmx->pc++;
+}
+
+/*
+ * Dispatch core shared by run() and step_n().
+ *
+ * Every handler in execute.h is the inlined body of the matching instruction
+ * function above (add, push, over, ...). pc, sp, rp, the top of the work
+ * stack and the stack/memory pointers live in locals for the whole loop and
+ * are only written back to the PMX around out-of-line calls (halt, device
+ * handlers, tracing) and when the loop exits. Operands come from the
+ * predecoded instruction rather than from memory.
+ *
+ * With GCC/Clang the handlers are threaded through a computed-goto table,
+ * otherwise (or with -DPMX_NO_COMPUTED_GOTO) a plain switch jumps to the
+ * same labels.
+ *
+ * The loop is compiled twice from the same source. Programs that pass the
+ * load-time verifier (verify.c) run on the unchecked interpreter, everything
+ * else on the checked one, which stops the machine instead of popping an
+ * empty stack or storing outside memory. Loading a program resets the
+ * predecode cache, so its handlers always come from the variant running it.
+ */
+#define OPCODE_TABLE_SIZE 0x400
+
+// opcode, handler label, length in words, ends a basic block
+#define PMX_OPCODES(X) \
+    X(0x00, halt, 1, 1)   X(0x01, load, 2, 0)   X(0x02, load, 2, 0)   \
+    X(0x03, load, 2, 0)   X(0x04, load, 2, 0)   X(0x05, load, 2, 0)   \
+    X(0x06, load, 2, 0)   X(0x07, load, 2, 0)   X(0x08, load, 2, 0)   \
+    X(0x09, add, 1, 0)    X(0x0A, sub, 1, 0)    X(0x0B, push, 2, 0)   \
+    X(0x0C, pop, 2, 0)    X(0x0D, equal, 1, 0)  X(0x0E, gth, 1, 0)    \
+    X(0x0F, lth, 1, 0)    X(0x10, dup, 1, 0)    X(0x11, pot, 2, 0)    \
+    X(0x12, ovr, 1, 0)    X(0x13, inc, 1, 0)    X(0x14, dcr, 1, 0)    \
+    X(0x15, mul, 1, 0)    X(0x16, div, 1, 0)    X(0x17, mod, 1, 0)    \
+    X(0x18, and, 1, 0)    X(0x19, or, 1, 0)     X(0x1A, xor, 1, 0)    \
+    X(0x1B, shl, 1, 0)    X(0x1C, shr, 1, 0)                          \
+    X(0x20, mov, 5, 0)    X(0x23, pow, 1, 0)    X(0x24, sqrt, 1, 0)   \
+    X(0x30, copy, 1, 0)   X(0x31, fill, 1, 0)   X(0x32, cmp, 1, 0)    \
+    X(0x33, vadd, 1, 0)   X(0x34, vscale, 1, 0) X(0x35, vdot, 1, 0)   \
+    X(0x25, abs, 1, 0)    X(0xAA, str, 1, 0)    X(0xAF, dvo, 2, 0)    \
+    X(0xBF, dvw, 2, 0)    X(0xDE, goto, 1, 1)   X(0xDF, jmp, 1, 1)    \
+    X(0xEE, rmv, 1, 0)    X(0xEF, jnz, 1, 1)    X(0xFE, rpc, 1, 0)    \
+    X(0xFF, ret, 1, 0)    X(0x1CF, swap, 3, 0)  X(0x2CF, swap, 3, 0)  \
+    X(0x3CF, swap, 3, 0)
+
+/*
+ * Superinstructions, fused when a block is decoded: the pattern's
+ * instructions in order, its handler label, the handler of its first
+ * instruction and how many instructions it counts as. They run only when the
+ * whole sequence fits in the budget and nothing traces or profiles single
+ * steps, otherwise the first instruction runs on its own. Stack slots the
+ * sequence would push and pop again are skipped.
+ *
+ *   POT value, POT addr, STR          store_const   (WCHR fields)
+ *   POT label, GOTO                   call          (CALL)
+ *   POT value, JNZ                    pot_jnz
+ *   DUP, POT value, EQUAL, JNZ        dup_case
+ *   PUSH r, INC|DCR, POP r            inc_reg, dcr_reg
+ */
+#define PMX_FUSED(X) \
+    X(1, store_const, pot, 3) X(2, call, pot, 2)  X(3, pot_jnz, pot, 2) \
+    X(4, dup_case, dup, 4)    X(5, inc_reg, push, 3) X(6, dcr_reg, push, 3)
+
+#define FUSED_COUNT 7
+
+#define LENGTH_ENTRY(code, name, length, ends) [code] = length,
+#define ENDS_ENTRY(code, name, length, ends) [code] = ends,
+
+static const unsigned char insn_length[OPCODE_TABLE_SIZE] = { PMX_OPCODES(LENGTH_ENTRY) };
+static const unsigned char insn_ends_block[OPCODE_TABLE_SIZE] = { PMX_OPCODES(ENDS_ENTRY) };
+
+/**
+ * @brief Length in words of the instruction with this opcode, 0 if unknown.
+ */
+unsigned int
+opcode_length(unsigned int op) {
+    return op < OPCODE_TABLE_SIZE ? insn_length[op] : 0;
+}
+
+/*
+ * Predecode cache: pmx->code[pc] holds the decoded instruction starting at pc
+ * for every pc inside the loaded program. Entries are filled a basic block at
+ * a time the first time execution reaches them, and reset by stores into the
+ * program so self-modifying code is decoded again. A program translated by
+ * pmxaot is dropped the same way, the interpreter takes over from it. A
+ * reset also verifies the program now in memory from the current pc.
+ */
+void
+predecode_reset(PMX *pmx, int length) {
+    pmx->native = NULL;
+    free(pmx->code);
+    pmx->code = length > 0 ? calloc(length, sizeof(PMXInsn)) : NULL;
+    pmx->code_size = pmx->code != NULL ? length : 0;
+    if (pmx->jit) jit_reset(pmx->jit, pmx->code_size);
+    pmx->verified = pmx->code_size > 0 && verify_program(pmx, NULL);
+}
+
+void
+predecode_invalidate(PMX *pmx, unsigned int addr) {
+    if (addr >= (unsigned int)pmx->code_size) return;
+    pmx->native = NULL;
+    // Any instruction starting up to PMX_INSN_MAX - 1 words earlier has addr as an operand
+    unsigned int first = addr >= PMX_INSN_MAX - 1 ? addr - (PMX_INSN_MAX - 1) : 0;
+    for (unsigned int i = first; i <= addr; i++) {
+        pmx->code[i].length = 0;
     }
+    if (pmx->jit) jit_invalidate(pmx->jit, addr);
+}
 
-    // Write the PMX state to the file
+static void
+decode_insn(const unsigned int *mem, unsigned int at, PMXInsn *insn, const void *const *table, const void *unknown) {
+    unsigned int op = mem[at];
+    unsigned int length = op < OPCODE_TABLE_SIZE ? insn_length[op] : 0;
 
-    if (opcode != 0x00) {
-        fprintf(file, "(%d) \tOPCODE: %x (%s)\n", pmx->pc, opcode, get_assembly_instruction(opcode));
-        fprintf(file, "\t\tWST: [ ");
-        for (int i = 0; i <= pmx->sp; i++) {
-            fprintf(file, "%d ", pmx->wst[i]);
-        }
-        fprintf(file, "]\n");
-        fprintf(file, "\t\tRST: [ ");
-        for (int i = 0; i <= pmx->rp; i++) {
-            fprintf(file, "%d ", pmx->rst[i]);
-        }
-        fprintf(file, "]\n");
-        fprintf(file, "\t\tR1=%d, R2=%d, R3=%d, R4=%d, R5=%d, R6=%d, R7=%d, R8=%d\n", pmx->registers[0], pmx->registers[1], pmx->registers[2], pmx->registers[3],pmx->registers[4],pmx->registers[5],pmx->registers[6],pmx->registers[7]);
-        fprintf(file, "\t\tDISPLAY ADDR: [ ");
-        for (int i = DISPLAY_BLOCK; i <= DISPLAY_BLOCK + 100; i++) {
-            fprintf(file, "%d ", pmx->memory[i]);
+    insn->op = op;
+    insn->handler = length ? (table ? table[op] : NULL) : unknown;
+    insn->length = length ? length : 1;
+    insn->fused = 0;
+    for (unsigned int i = 1; i < insn->length; i++) {
+        insn->arg[i - 1] = mem[at + i];
+    }
+}
+
+// Opcode of the decoded instruction count instructions after at, 0 if there is none
+static unsigned int
+fuse_peek(const PMXInsn *code, unsigned int code_size, unsigned int at, int count) {
+    while (count-- > 0) {
+        at += code[at].length;
+        if (at >= code_size || code[at].length == 0) return 0;
+    }
+    return code[at].op;
+}
+
+static unsigned int
+fuse_match(const PMXInsn *code, unsigned int code_size, unsigned int at) {
+    const PMXInsn *insn = &code[at];
+    unsigned int next = fuse_peek(code, code_size, at, 1);
+
+    switch (insn->op) {
+    case 0x11:
+        if (next == 0x11 && fuse_peek(code, code_size, at, 2) == 0xAA) return 1;
+        if (next == 0xDE) return 2;
+        if (next == 0xEF) return 3;
+        return 0;
+    case 0x10:
+        if (next == 0x11 && fuse_peek(code, code_size, at, 2) == 0x0D && fuse_peek(code, code_size, at, 3) == 0xEF) return 4;
+        return 0;
+    case 0x0B:
+        // Both register operands must be valid, PUSH and POP skip invalid ones
+        if ((next == 0x13 || next == 0x14) && fuse_peek(code, code_size, at, 2) == 0x0C &&
+            insn->arg[0] - 1 < REGISTER_NUMBER && insn[3].arg[0] - 1 < REGISTER_NUMBER) {
+            return next == 0x13 ? 5 : 6;
         }
-        fprintf(file, "]\n");
-        fprintf(file, "-------------------------------------\n");
+        return 0;
+    default:
+        return 0;
     }
-    
-    // Close the file
-    fclose(file);
 }
 
-void 
-ret(PMX *pmx) {
-    pmx->rst[++pmx->rp] = pmx->wst[pmx->sp--];
-    pmx->pc++;
+/*
+ * Decodes the block at at, then fuses the superinstructions starting in it.
+ * A pattern never extends past the end of a block and spans at most
+ * PMX_INSN_MAX words, so a store into any of its words also resets its first
+ * entry and the pattern is matched again.
+ */
+static void
+decode_block(const unsigned int *mem, PMXInsn *code, unsigned int code_size, unsigned int at,
+             const void *const *fused, const void *const *table, const void *unknown) {
+    unsigned int first = at;
+    while (at < code_size && code[at].length == 0) {
+        decode_insn(mem, at, &code[at], table, unknown);
+        if (code[at].op >= OPCODE_TABLE_SIZE || !insn_length[code[at].op] || insn_ends_block[code[at].op]) break;
+        at += code[at].length;
+    }
+    for (unsigned int i = first; i < code_size && i <= at; i += code[i].length) {
+        if (code[i].length == 0) break;
+        code[i].fused = fuse_match(code, code_size, i);
+        if (code[i].fused && fused) code[i].handler = fused[code[i].fused];
+    }
 }
 
-void 
+/*
+ * Top-of-stack caching: the top of the work stack lives in the local tos
+ * while the loop runs, wst[sp] is stale and only the values below it are in
+ * wst. A push spills the old top, a pop fills the new one from wst, and an
+ * instruction that reads the top two and leaves one (ADD, EQUAL, ...) loads
+ * once and stores nothing. SYNC spills so the PMX is whole again for the
+ * device handlers, tracing, the JIT and the caller; RELOAD fills.
+ *
+ * sp is -1 when the stack is empty, that spill and fill go to wst[0],
+ * which holds nothing then. -DPMX_NO_TOS_CACHE keeps the top in wst[sp].
+ */
+#ifndef PMX_NO_TOS_CACHE
+#define TOS_CACHE 1
+#define TOP tos
+#define SPILL() (wst[sp >= 0 ? sp : 0] = tos)
+#define FILL()  (tos = wst[sp >= 0 ? sp : 0])
+#else
+#define TOS_CACHE 0
+#define TOP wst[sp]
+#define SPILL() ((void)0)
+#define FILL()  ((void)0)
+#endif
+
+#define PUSH(value) do { unsigned int pushed_ = (value); SPILL(); sp++; TOP = pushed_; } while (0)
+#define DROP(n) do { sp -= (n); FILL(); } while (0)
+// Replace the top n values with one
+#define REDUCE(n, value) do { unsigned int reduced_ = (value); sp -= (n) - 1; TOP = reduced_; } while (0)
+
+#define SYNC()   do { SPILL(); pmx->pc = pc; pmx->sp = sp; pmx->rp = rp; } while (0)
+#define RELOAD() do { pc = pmx->pc; sp = pmx->sp; rp = pmx->rp; FILL(); } while (0)
+
+#define TRACE()  do { if (trace) { SYNC(); trace_step(trace, pmx, op); } } while (0)
+#define INVALIDATE(addr) do { if ((addr) < code_size) predecode_invalidate(pmx, (addr)); } while (0)
+
+// Point insn at the decoded instruction at pc, decoding its block on a miss
+#define FETCH() do { \
+        if ((unsigned int)pc < code_size) { \
+            insn = &code[pc]; \
+            if (insn->length == 0) decode_block(mem, code, code_size, pc, FUSED_LABELS, DECODE_LABELS); \
+        } else { \
+            CHECK((unsigned int)pc <= memory_size - PMX_INSN_MAX); \
+            decode_insn(mem, pc, &scratch, DECODE_LABELS); \
+            insn = &scratch; \
+        } \
+        op = insn->op; \
+    } while (0)
+
+#if defined(__GNUC__) && !defined(PMX_NO_COMPUTED_GOTO)
+#define PMX_THREADED 1
+#define TABLE_ENTRY(code, name, length, ends) [code] = &&op_##name,
+#define FUSED_ENTRY(kind, name, first, count) [kind] = &&fuse_##name,
+#define FUSED_LABELS fused_table
+#define DECODE_LABELS table, &&op_unknown
+#define DISPATCH() do { FETCH(); goto *insn->handler; } while (0)
+#else
+#define CASE_ENTRY(code, name, length, ends) case code: goto op_##name;
+#define FUSED_CASE(kind, name, first, count) case kind: goto fuse_##name;
+#define FUSED_LABELS NULL
+#define DECODE_LABELS NULL, NULL
+#define DISPATCH() goto dispatch
+#endif
+
+// Opcode counts and a pc sample every PROFILE_PERIOD instructions, with -DPMX_PROFILER only
+#ifdef PMX_PROFILER
+#define PROFILE() do { \
+        if (profile) { \
+            profile->ops[op < PROFILE_OPCODES ? op : PROFILE_OPCODES]++; \
+            if (--profile->countdown == 0) profile_sample(profile, pc); \
+        } \
+    } while (0)
+#define PROFILE_PORT(counter) do { if (profile) profile->counter[port]++; } while (0)
+#else
+#define PROFILE() do { } while (0)
+#define PROFILE_PORT(counter) do { } while (0)
+#endif
+
+/*
+ * Jumps hand hot targets to the compiled blocks, with -DPMX_JIT only, see
+ * jit.c. Where the native code stops counts as a jump too, so blocks only
+ * ever reached from other blocks get hot as well.
+ */
+#ifdef PMX_JIT
+#define JIT() do { \
+        while (jit && (unsigned int)pc < code_size && jit_ready(jit, pmx, pc)) { \
+            SYNC(); \
+            long ran = jit_run(pmx, budget - count); \
+            RELOAD(); \
+            count += ran; \
+            if (count >= budget) goto out; \
+            if (ran == 0) break; \
+        } \
+    } while (0)
+#else
+#define JIT() do { } while (0)
+#endif
+
+#define NEXT() do { PROFILE(); TRACE(); if (++count >= budget) goto out; DISPATCH(); } while (0)
+#define NEXT_JUMP() do { PROFILE(); TRACE(); if (++count >= budget) goto out; JIT(); DISPATCH(); } while (0)
+
+/*
+ * Checks of the checked interpreter, compiled out of the unchecked one.
+ * STACK(in, out): the instruction reads the top in values and leaves out in
+ * their place.
+ */
+#define CHECK(ok) do { if (CHECKED && !(ok)) goto fault; } while (0)
+#define STACK(in, out) CHECK(sp + 1 >= (in) && sp + 1 - (in) + (out) <= wst_size)
+
+// A superinstruction of n instructions runs as its first one instead
+#ifdef PMX_PROFILER
+#define UNFUSED(n) (trace || profile || count + (n) > budget)
+#else
+#define UNFUSED(n) (trace || count + (n) > budget)
+#endif
+
+#define EXECUTE execute_unchecked
+#define CHECKED 0
+#include "./execute.h"
+#undef EXECUTE
+#undef CHECKED
+
+#define EXECUTE execute_checked
+#define CHECKED 1
+#include "./execute.h"
+#undef EXECUTE
+#undef CHECKED
+
+// Programs verify_program() accepted run without the checks
+static long
+execute(PMX *pmx, long budget, int *running) {
+    if (pmx->verified) return execute_unchecked(pmx, budget, running);
+    return execute_checked(pmx, budget, running);
+}
+
+/**
+ * @brief The interpreter core without step accounting.
+ *
+ * Runs at most budget instructions from pmx->pc and clears *running when the
+ * machine halts or meets an unknown opcode. Translated programs call it for
+ * whatever they cannot run themselves.
+ *
+ * @return The number of instructions executed.
+ */
+long
+interpret(PMX *pmx, long budget, int *running) {
+    return execute(pmx, budget, running);
+}
+
+// The translated program when there is one, tracing and profiling need the interpreter. The
+// translation has no bounds checks, so like the JIT it only runs programs that verified
+static long
+execute_tier(PMX *pmx, long budget, int *running) {
+    if (pmx->native != NULL && pmx->verified && pmx->trace == NULL && pmx->profile == NULL) {
+        return pmx->native(pmx, budget, running);
+    }
+    return execute(pmx, budget, running);
+}
+
+long 
 run(PMX *pmx) {
     int running = 1;
-    FILE *file = fopen("./log.txt", "a");
-    if (file == NULL) {
-        // Handle file open error
-        perror("Error opening file");
-        return;
-    }
-    fclose(file);
+    long done = 0;
 
     while (running) {
-        int instruction = pmx->memory[pmx->pc];
-        // printf("%x\n",instruction);
-        switch (instruction) {
-            case 0x00: running=halt(pmx, running); break;
-            case 0x01: load(pmx, 1, pmx->memory[pmx->pc + 1]); break;
-            case 0x02: load(pmx, 2, pmx->memory[pmx->pc + 1]); break;
-            case 0x03: load(pmx, 3, pmx->memory[pmx->pc + 1]); break;
-            case 0x04: load(pmx, 4, pmx->memory[pmx->pc + 1]); break;
-            case 0x05: load(pmx, 5, pmx->memory[pmx->pc + 1]); break;
-            case 0x06: load(pmx, 6, pmx->memory[pmx->pc + 1]); break;
-            case 0x07: load(pmx, 7, pmx->memory[pmx->pc + 1]); break;
-            case 0x08: load(pmx, 8, pmx->memory[pmx->pc + 1]); break;
-            case 0x09: add(pmx); break;
-            case 0x0A: sub(pmx); break;
-            case 0x0B: push(pmx, pmx->memory[pmx->pc + 1]); break;
-            case 0x0C: pop(pmx, pmx->memory[pmx->pc + 1]); break;
-            case 0x0D: equal(pmx); break;
-            case 0x0F: lower_than(pmx); break;
-            case 0x10: duplicate(pmx); break;
-            case 0x11: put_on_top_of_stack(pmx, pmx->memory[pmx->pc + 1]); break;
-            case 0x12: over(pmx); break;
-            case 0x13: increase(pmx); break;
-            case 0x14: decrease(pmx); break;
-            case 0x20: mov(pmx); break;
-            case 0x24: sqrt_instruction(pmx); break;
-            case 0x25: abs_instruction(pmx); break;
-            case 0x23: power(pmx); break;
-            case 0xAA: store(pmx); break;
-            case 0xAF: console_deo(pmx, pmx->memory[pmx->pc + 1]); break;
-            case 0xBF: dev_write(pmx, pmx->memory[pmx->pc + 1]); break;
-            case 0xDE: goto_instruction(pmx); break;
-            case 0xDF: jump(pmx); break;
-            case 0xEE: remove_top_of_stack(pmx); break;
-            case 0xEF: jump_if_not_zero(pmx); break;
-            case 0xFE: read_pc(pmx); break;
-            case 0xFF: ret(pmx); break;
-            case 0x1CF: swap(pmx); break;
-            case 0x2CF: swap(pmx); break;
-            case 0x3CF: swap(pmx); break;
-            default: running = 0; break;
-        }
-        dump(pmx, instruction);
+        PROFILE_TIME(pmx, vm_seconds, done += execute_tier(pmx, LONG_MAX, &running));
     }
+    return done;
 }
 
-void 
-step(PMX *pmx) {
+int
+step_n(PMX *pmx, int cycles) {
     int running = 1;
-    int instruction;
-    FILE *file = fopen("./log.txt", "a");
-    if (file == NULL) {
-        // Handle file open error
-        perror("Error opening file");
-        return;
+    long left = pmx->steps - pmx->step;
+    long budget = cycles < left ? cycles : left;
+    long done = 0;
+
+    if (cycles <= 0) return 0;
+    if (budget > 0) {
+        PROFILE_TIME(pmx, vm_seconds, done = execute_tier(pmx, budget, &running));
     }
-    fclose(file);
-    if (pmx->step < pmx->steps){
-        instruction = pmx->memory[pmx->pc];
-        pmx->step++;
-    }
-    else {
-        instruction = 0x00;
-    }
-    switch (instruction) {
-        case 0x00: running=halt(pmx, running); break;
-        case 0x01: load(pmx, 1, pmx->memory[pmx->pc + 1]); break;
-        case 0x02: load(pmx, 2, pmx->memory[pmx->pc + 1]); break;
-        case 0x03: load(pmx, 3, pmx->memory[pmx->pc + 1]); break;
-        case 0x04: load(pmx, 4, pmx->memory[pmx->pc + 1]); break;
-        case 0x05: load(pmx, 5, pmx->memory[pmx->pc + 1]); break;
-        case 0x06: load(pmx, 6, pmx->memory[pmx->pc + 1]); break;
-        case 0x07: load(pmx, 7, pmx->memory[pmx->pc + 1]); break;
-        case 0x08: load(pmx, 8, pmx->memory[pmx->pc + 1]); break;
-        case 0x09: add(pmx); break;
-        case 0x0A: sub(pmx); break;
-        case 0x0B: push(pmx, pmx->memory[pmx->pc + 1]); break;
-        case 0x0C: pop(pmx, pmx->memory[pmx->pc + 1]); break;
-        case 0x0D: equal(pmx); break;
-        case 0x0F: lower_than(pmx); break;
-        case 0x10: duplicate(pmx); break;
-        case 0x11: put_on_top_of_stack(pmx, pmx->memory[pmx->pc + 1]); break;
-        case 0x12: over(pmx); break;
-        case 0x13: increase(pmx); break;
-        case 0x14: decrease(pmx); break;
-        case 0x20: mov(pmx); break;
-        case 0x24: sqrt_instruction(pmx); break;
-        case 0x25: abs_instruction(pmx); break;
-        case 0x23: power(pmx); break;
-        case 0xAA: store(pmx); break;
-        case 0xAF: console_deo(pmx, pmx->memory[pmx->pc + 1]); break;
-        case 0xBF: dev_write(pmx, pmx->memory[pmx->pc + 1]); break;
-        case 0xDE: goto_instruction(pmx); break;
-        case 0xDF: jump(pmx); break;
-        case 0xEE: remove_top_of_stack(pmx); break;
-        case 0xEF: jump_if_not_zero(pmx); break;
-        case 0xFE: read_pc(pmx); break;
-        case 0xFF: ret(pmx); break;
-        case 0x1CF: swap(pmx); break;
-        case 0x2CF: swap(pmx); break;
-        case 0x3CF: swap(pmx); break;
-        default: running = 0; break;
-    }
-    dump(pmx, instruction);
+    // A stopped machine keeps re-executing the stopping instruction, charge
+    // the rest of the budget to it like repeated step() calls would.
+    pmx->step += running ? done : budget;
+    if (budget < cycles) {
+        halt(pmx, running);
+    }
+    return done;
+}
+
+void 
+step(PMX *pmx) {
+    step_n(pmx, 1);
 }
 
 #define MAX_LINE_LENGTH 20000
 
-void 
+/*
+ * strtok(line, ",") without the hidden static state, so several threads can
+ * load programs at once.
+ */
+static char *
+next_token(char **cursor) {
+    char *token = *cursor + strspn(*cursor, ",");
+    if (*token == '\0') return NULL;
+    char *end = token + strcspn(token, ",");
+    *cursor = *end != '\0' ? end + 1 : end;
+    *end = '\0';
+    return token;
+}
+
+int 
 load_program_from_file(PMX *pmx, const char *filename) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         printf("Failed to open file: %s\n", filename);
-        return;
+        return 0;
     }
 
     // First pass: count the number of instructions
     int program_size = 0;
     char line[MAX_LINE_LENGTH];
     while (fgets(line, sizeof(line), file) != NULL) {
-        char *token = strtok(line, ",");
-        while (token != NULL) {
+        char *cursor = line;
+        while (next_token(&cursor) != NULL) {
             program_size++;
-            token = strtok(NULL, ",");
         }
     }
 
@@ -542,7 +1179,7 @@ load_program_from_file(PMX *pmx, const char *filename) {
     if (program == NULL) {
         printf("Failed to allocate memory for program\n");
         fclose(file);
-        return;
+        return 0;
     }
 
     // Reset file pointer to the beginning
@@ -551,8 +1188,9 @@ load_program_from_file(PMX *pmx, const char *filename) {
     // Second pass: read the instructions
     int index = 0;
     while (fgets(line, sizeof(line), file) != NULL) {
-        char *token = strtok(line, ",");
-        while (token != NULL) {
+        char *cursor = line;
+        char *token;
+        while ((token = next_token(&cursor)) != NULL) {
             int value;
             if (strncmp(token, "0x", 2) == 0) {
                 sscanf(token, "%x", &value);
@@ -560,18 +1198,18 @@ load_program_from_file(PMX *pmx, const char *filename) {
                 sscanf(token, "%d", &value);
             }
             program[index++] = value;
-            token = strtok(NULL, ",");
         }
     }
 
     fclose(file);
 
     // Load the program into memory
-    pmx->registers[7] = program_size;
-    load_program(pmx, program, program_size);
+    int loaded = load_program(pmx, program, program_size);
+    if (loaded) pmx->registers[7] = program_size;
 
     // Free the allocated memory
     free(program);
+    return loaded;
 }
 
 
@@ -2,15 +2,66 @@
 #ifndef PMX_H
 #define PMX_H
 
-#define MEMORY_SIZE (1024 * 64 * 10) // 10 KB memory
+#define MEMORY_SIZE (1024 * 64 * 10) // default memory size in words
 #define REGISTER_NUMBER (8)
 #define DISPLAY_SIZE (480000)
 #define DISPLAY_BLOCK (MEMORY_SIZE - DISPLAY_SIZE)
 
+#define PMX_INSN_MAX (5) // longest instruction in words (MOV)
+
+typedef struct PMXTrace PMXTrace;
+typedef struct PMXDisplay PMXDisplay;
+typedef struct PMXProfile PMXProfile;
+typedef struct PMXJit PMXJit;
+typedef struct PMXConsole PMXConsole;
+
+// Predecoded instruction, length is 0 until the entry has been decoded
 typedef struct {
+    const void *handler;
+    unsigned int op;
+    unsigned short length;
+    unsigned short fused; // superinstruction starting here, 0 if none
+    unsigned int arg[PMX_INSN_MAX - 1];
+} PMXInsn;
+
+typedef struct PMX PMX;
+
+// Translated program from pmxaot, runs like interpret() and falls back to it
+typedef long (*PMXNative)(PMX *pmx, long budget, int *running);
+
+// Called with the port a DVW wrote to or a DVO addressed
+typedef void (*PMXDeviceHandler)(PMX *pmx, Uint8 port);
+
+typedef struct {
+    PMXDeviceHandler write;   // after DVW stored into dev[port]
+    PMXDeviceHandler output;  // on DVO
+} PMXPort;
+
+/**
+ * @brief Per-instance memory layout, sizes are in words.
+ *
+ * The display region is where the display device reads its character
+ * records from.
+ */
+typedef struct {
+    int memory_size;
+    int wst_size;
+    int rst_size;
+    int display_block;
+    int display_size;
+} PMXConfig;
+
+extern const PMXConfig pmx_default_config;
+
+struct PMX {
     unsigned int *memory;
     unsigned int *wst;  // Stack
     unsigned int *rst;  // Stack
+    int memory_size;
+    int wst_size;
+    int rst_size;
+    int display_block;
+    int display_size;
     int sp;
     int rp;
     int pc;
@@ -19,10 +70,22 @@ typedef struct {
     int registers[REGISTER_NUMBER];  // R1, R2, R3
     int dev[0x100];
     int time;
-} PMX;
+    PMXTrace *trace;  // NULL when tracing is off
+    PMXDisplay *display;  // NULL until display_register()
+    PMXProfile *profile;  // NULL unless profiling
+    PMXJit *jit;      // NULL unless the JIT is on
+    PMXConsole *console;  // console device, see devices/console.h
+    PMXNative native; // NULL unless the loaded program was translated ahead of time and verified
+    PMXInsn *code;    // predecode cache covering memory[0, code_size)
+    int code_size;
+    int verified;     // the loaded program passed verify_program() and runs unchecked
+    PMXPort ports[0x100];
+};
 
 void init_pmx(PMX *pmx);
-void load_program(PMX *pmx, int *program, int length);
+int init_pmx_config(PMX *pmx, const PMXConfig *config);
+void free_pmx(PMX *pmx);
+int load_program(PMX *pmx, int *program, int length);
 void unload_program(PMX *pmx);
 void add(PMX *pmx);
 void sub(PMX *pmx);
@@ -39,21 +102,44 @@ void equal(PMX *pmx);
 void greater_than(PMX *pmx);
 void lower_than(PMX *pmx);
 void swap(PMX *pmx);
-void console_deo(PMX *pmx, int addr);
 void increase(PMX *pmx);
 void decrease(PMX *pmx);
 void remove_top_of_stack(PMX *pmx);
 void dev_write(PMX *pmx, int addr);
+void register_device(PMX *pmx, int first, int last, PMXDeviceHandler write, PMXDeviceHandler output);
+void device_write(PMX *pmx, Uint8 port, unsigned int value);
+void device_output(PMX *pmx, Uint8 port);
 void put_on_top_of_stack(PMX *pmx, unsigned int value);
 void goto_instruction(PMX *pmx);
+int int_div(int a, int b);
+int int_mod(int a, int b);
+int int_pow(int base, int exponent);
+int int_sqrt(int value);
 void power(PMX *pmx);
 void sqrt_instruction(PMX *pmx);
 void abs_instruction(PMX *pmx);
 void store(PMX *pmx);
 void ret(PMX *pmx);
-void mov(PMX *pmx);
-void run(PMX *pmx);
+void block_copy(PMX *pmx);
+void block_fill(PMX *pmx);
+void block_compare(PMX *pmx);
+void block_add(PMX *pmx);
+void block_scale(PMX *pmx);
+void block_dot(PMX *pmx);
+void memory_copy(PMX *pmx, unsigned int dst, unsigned int src, unsigned int count);
+void memory_fill(PMX *pmx, unsigned int dst, unsigned int value, unsigned int count);
+int memory_compare(const PMX *pmx, unsigned int a, unsigned int b, unsigned int count);
+void memory_add(PMX *pmx, unsigned int dst, unsigned int src, unsigned int count);
+void memory_scale(PMX *pmx, unsigned int dst, unsigned int factor, unsigned int count);
+unsigned int memory_dot(const PMX *pmx, unsigned int a, unsigned int b, unsigned int count);
+long run(PMX *pmx);
+long interpret(PMX *pmx, long budget, int *running);
 void step(PMX *pmx);
-void load_program_from_file(PMX *pmx, const char *filename);
+int step_n(PMX *pmx, int cycles);
+void predecode_reset(PMX *pmx, int length);
+void predecode_invalidate(PMX *pmx, unsigned int addr);
+unsigned int opcode_length(unsigned int op);
+int load_program_from_file(PMX *pmx, const char *filename);
+const char* get_assembly_instruction(unsigned char opcode);
 
 #endif // PMX_H
\ No newline at end of file
@@ -5,76 +5,304 @@
 
 #include <SDL.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <limits.h>
 #include "./pmx.h"
 #include "./devices/display.h"
+#include "./devices/console.h"
+#include "./trace.h"
+#include "./rom.h"
+#include "./snapshot.h"
+#include "./replay.h"
+#include "./profile.h"
+#include "./jit.h"
+#ifdef PMX_AOT
+#include "./aot.h"
+#endif
 
 /**
- * @brief Perform device-specific operations based on the given address.
+ * @brief Frame pacing settings for emu_run.
  *
- * This function performs device-specific operations based on the given address.
- * It extracts the low nibble of the address, and performs
- * operations based on the extracted value.
+ * Each frame runs either a fixed number of instructions (cycles_per_frame)
+ * or, when that is 0, as many as fit in frame_budget_ms of wall-clock time.
+ * Events are polled, the screen refreshed and presented once per
+ * frame, at most refresh_rate times per second, and console output buffered
+ * during the frame is written out. Headless runs skip events
+ * and pacing and stop once the program has finished.
+ *
+ * Windowed runs present from a render thread unless --no-render-thread is
+ * given, emu_run then only hands frames over and never waits on the window.
+ * Headless runs present in line so frame hashes stay one per frame, unless
+ * --render-thread asks otherwise.
+ *
+ * A run can start from a snapshot instead of the program, and save one at
+ * the first frame boundary at or after snapshot_at instructions (-1 saves
+ * on exit).
+ *
+ * Input reaches the VM only at frame boundaries while record_input or
+ * replay_input is set. Recording logs each event with pmx->step at the
+ * boundary it arrived at. Replaying runs headless, ends frames exactly at the
+ * logged steps and delivers the events there, so the program sees the same
+ * input at the same instruction as in the recorded run.
+ */
+typedef struct EmuConfig {
+    int cycles_per_frame;
+    int frame_budget_ms;
+    int refresh_rate;
+    int headless;
+    const char *load_snapshot;
+    const char *save_snapshot;
+    long snapshot_at;
+    const char *record_input;
+    const char *replay_input;
+} EmuConfig;
+
+#define EMU_TIME_SLICE 4096 // instructions between clock checks in budget mode
+
+/**
+ * @brief Run the VM for one frame worth of instructions.
  *
  * @param pmx The PMX structure.
- * @param addr The address to perform operations on.
+ * @param config The frame pacing settings.
+ * @param until The frame ends at this pmx->step at the latest.
+ * @return The number of instructions executed.
  */
-void 
-emu_deo(PMX *pmx, Uint32 addr) {
-    //todo: actual implementation, loop over dev memory?
-    //? maybe don't loop inside emu_deo, but inside the main loop?
-    Uint8 lv = (addr >> 4) & 0x0F;
-    
-    switch (lv)
-    {
-        case 0x00: break;
-        case 0x01: display_deo(pmx,addr); break;
-    
-    default:
-        break;
+static long
+emu_frame(PMX *pmx, const EmuConfig *config, long until) {
+    long done = 0;
+
+    if (config->cycles_per_frame > 0) {
+        long cycles = until - pmx->step < config->cycles_per_frame ? until - pmx->step : config->cycles_per_frame;
+        return step_n(pmx, (int)cycles);
     }
+
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 deadline = SDL_GetPerformanceCounter() + freq * config->frame_budget_ms / 1000;
+    while (pmx->step < pmx->steps && pmx->step < until) {
+        long slice = until - pmx->step < EMU_TIME_SLICE ? until - pmx->step : EMU_TIME_SLICE;
+        done += step_n(pmx, (int)slice);
+        if (SDL_GetPerformanceCounter() >= deadline) break;
+    }
+    return done;
+}
+
+/**
+ * @brief Take the input that arrived during the frame.
+ *
+ * Records what stdin holds for the console when recorder is set, delivers
+ * the logged events due by now when replay is set.
+ *
+ * @return 1 if a replayed event closes the window.
+ */
+static int
+emu_input(PMX *pmx, PMXReplay *recorder, PMXReplay *replay) {
+    int quit = 0;
+
+    if (recorder != NULL) {
+        unsigned char data[CONSOLE_INPUT];
+        int got = console_receive(pmx->console, data);
+        if (got > 0) replay_log(recorder, pmx->step, REPLAY_CONSOLE, data, got);
+    }
+
+    ReplayEvent event;
+    while (replay_next(replay) >= 0 && replay_next(replay) <= pmx->step && replay_take(replay, &event)) {
+        switch (event.kind) {
+        case REPLAY_QUIT:
+            quit = 1;
+            break;
+        case REPLAY_CONSOLE:
+            console_feed(pmx->console, event.data, event.length);
+            break;
+        default:
+            break;
+        }
+    }
+    return quit;
 }
 
 /**
  * @brief Run the PMX11 emulator.
  *
- * This function runs the PMX11 emulator. It initializes the necessary components,
- * loads the program from a file, and enters the main loop where it processes events,
- * executes the program, updates the display, performs device-specific operations,
- * and increments the time counter.
+ * This function restores the snapshot given in the config, or loads the binary
+ * program.bin, falling back to the CSV program.rom (a -DPMX_AOT build starts
+ * the program translated by pmxaot instead), and enters the main loop. Every
+ * frame it executes a budget of instructions, then processes events, refreshes
+ * the screen from display memory, presents it once and waits for the next
+ * refresh. Device side effects happen during execution through the device
+ * bus. The time counter advances by the number of executed instructions.
+ * With an input log to record or replay, input is taken at the end of each
+ * frame, see EmuConfig.
  *
  * @param pmx The PMX structure.
+ * @param config The frame pacing settings.
  */
 void 
-emu_run(PMX *pmx) {
-    SDL_Event e;
+emu_run(PMX *pmx, const EmuConfig *config) {
     int  quit = 0;
-    load_program_from_file(pmx, "program.rom");
+    int snapshot_saved = config->save_snapshot == NULL;
+    Uint32 frame_ms = 1000 / (config->refresh_rate > 0 ? config->refresh_rate : 60);
+    PMXReplay *recorder = NULL, *replay = NULL;
+    if (config->record_input != NULL && (recorder = replay_record(config->record_input)) == NULL) return;
+    if (config->replay_input != NULL && (replay = replay_open(config->replay_input)) == NULL) {
+        replay_close(recorder);
+        return;
+    }
+    pmx->console->input_fed = recorder != NULL || replay != NULL;
+    if (config->load_snapshot != NULL) {
+        if (!snapshot_load(pmx, config->load_snapshot)) {
+            replay_close(recorder);
+            replay_close(replay);
+            return;
+        }
+    } else {
+#ifdef PMX_AOT
+        // Built by make aot, the program is compiled in
+        if (!aot_load(pmx)) {
+            replay_close(recorder);
+            replay_close(replay);
+            return;
+        }
+#else
+        if (!load_rom(pmx, "program.bin") && !load_program_from_file(pmx, "program.rom")) {
+            replay_close(recorder);
+            replay_close(replay);
+            return;
+        }
+#endif
+    }
     
     // MAIN LOOP
     while (!quit) {
-        while (SDL_PollEvent(&e)) {if (e.type == SDL_QUIT) quit = 1;}
-        step(pmx); 
-        display_update();
-        for (int i=0; i<256; i++){
-            if (pmx->dev[i]==1){
-                emu_deo(pmx, i);
-            }
+        Uint32 frame_start = SDL_GetTicks();
+
+        if (pmx->step < pmx->steps) {
+            long until = replay_next(replay);
+            pmx->time += emu_frame(pmx, config, until >= 0 ? until : LONG_MAX);
+        }
+        if (!snapshot_saved && config->snapshot_at >= 0 && pmx->step >= config->snapshot_at) {
+            snapshot_save(pmx, config->save_snapshot);
+            snapshot_saved = 1;
+        }
+        if (!config->headless && (display_poll(pmx->display) & DISPLAY_QUIT)) {
+            quit = 1;
+            replay_log(recorder, pmx->step, REPLAY_QUIT, NULL, 0);
+        }
+        if (emu_input(pmx, recorder, replay)) {
+            quit = 1;
+        }
+        PROFILE_TIME(pmx, display_seconds, display_frame(pmx));
+        PROFILE_TIME(pmx, display_seconds, display_update(pmx->display));
+        console_flush(pmx->console);
+
+        if (config->headless) {
+            if (pmx->step >= pmx->steps) quit = 1;
+            continue;
+        }
+        Uint32 elapsed = SDL_GetTicks() - frame_start;
+        if (elapsed < frame_ms) {
+            SDL_Delay(frame_ms - elapsed);
         }
-        pmx->time++;
     }
+    if (!snapshot_saved) {
+        snapshot_save(pmx, config->save_snapshot);
+    }
+    replay_close(recorder);
+    replay_close(replay);
 }
 
 int 
 main(int argc, char* args[] ) {
-    FILE *file = fopen("./log.txt", "w");
-    if (file == NULL) {
-        perror("Error opening file");
-        return 0;
+    EmuConfig config = {
+        .cycles_per_frame = 0,
+        .frame_budget_ms = 12,
+        .refresh_rate = 60,
+        .snapshot_at = -1,
+    };
+    PMXConfig memory_config = pmx_default_config;
+    PMXDisplay display = { 0 };
+    int trace_level = TRACE_OFF;
+    const char *trace_file = "./trace.bin";
+    const char *profile_report = NULL;
+    const char *symbols = "./program.sym";
+    int use_jit = 0;
+    int render_thread = -1;
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? args[i + 1] : "";
+        if (strcmp(args[i], "--headless") == 0) {
+            config.headless = 1;
+        } else if (strcmp(args[i], "--hash-frames") == 0) {
+            display.hash_frames = 1;
+        } else if (strcmp(args[i], "--dump-frames") == 0) {
+            display.frame_prefix = value; i++;
+        } else if (strcmp(args[i], "--cycles") == 0) {
+            config.cycles_per_frame = atoi(value); i++;
+        } else if (strcmp(args[i], "--budget-ms") == 0) {
+            config.frame_budget_ms = atoi(value); i++;
+        } else if (strcmp(args[i], "--fps") == 0) {
+            config.refresh_rate = atoi(value); i++;
+        } else if (strcmp(args[i], "--memory") == 0) {
+            memory_config.memory_size = atoi(value); i++;
+        } else if (strcmp(args[i], "--wst") == 0) {
+            memory_config.wst_size = atoi(value); i++;
+        } else if (strcmp(args[i], "--rst") == 0) {
+            memory_config.rst_size = atoi(value); i++;
+        } else if (strcmp(args[i], "--display-block") == 0) {
+            memory_config.display_block = atoi(value); i++;
+        } else if (strcmp(args[i], "--display-size") == 0) {
+            memory_config.display_size = atoi(value); i++;
+        } else if (strcmp(args[i], "--load-snapshot") == 0) {
+            config.load_snapshot = value; i++;
+        } else if (strcmp(args[i], "--save-snapshot") == 0) {
+            config.save_snapshot = value; i++;
+        } else if (strcmp(args[i], "--snapshot-at") == 0) {
+            config.snapshot_at = atol(value); i++;
+        } else if (strcmp(args[i], "--record-input") == 0) {
+            config.record_input = value; i++;
+        } else if (strcmp(args[i], "--replay-input") == 0) {
+            // Replays run headless and unpaced
+            config.replay_input = value; i++;
+            config.headless = 1;
+        } else if (strcmp(args[i], "--profile") == 0) {
+            profile_report = value; i++;
+        } else if (strcmp(args[i], "--symbols") == 0) {
+            symbols = value; i++;
+        } else if (strcmp(args[i], "--render-thread") == 0) {
+            render_thread = 1;
+        } else if (strcmp(args[i], "--no-render-thread") == 0) {
+            render_thread = 0;
+        } else if (strcmp(args[i], "--jit") == 0) {
+            use_jit = 1;
+        } else if (strcmp(args[i], "--trace") == 0) {
+            trace_level = atoi(value); i++;
+        } else if (strcmp(args[i], "--trace-file") == 0) {
+            trace_file = value; i++;
+        }
     }
+
     PMX pmx;
-    init_pmx(&pmx);
-    initDisplay(600,420,0x000);
-    emu_run(&pmx);
+    if (!init_pmx_config(&pmx, &memory_config)) return 1;
+    pmx.trace = trace_open(&pmx, trace_file, trace_level);
+    const DisplayBackend *backend = config.headless ? &display_memory_backend : &display_sdl_backend;
+    display.threaded = render_thread >= 0 ? render_thread : !config.headless;
+    if (!initDisplay(&display, backend, 0x000)) {
+        trace_close(pmx.trace);
+        return 1;
+    }
+    display_register(&pmx, &display);
+    if (profile_report != NULL) {
+        profile_open(&pmx, symbols, strcmp(profile_report, "-") == 0 ? NULL : profile_report);
+    }
+    if (use_jit) jit_open(&pmx);
+    emu_run(&pmx, &config);
+    if (config.headless) {
+        printf("final frame hash: %016llx (%d frames)\n", (unsigned long long)display_hash(&display), display.frame);
+    }
+    closeDisplay(&display);
+    profile_close(pmx.profile);
+    jit_close(pmx.jit);
+    trace_close(pmx.trace);
+    free_pmx(&pmx);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,508 @@
+/**
+ * @file pmxaot.c
+ * @brief Ahead-of-time translator from a ROM to C, no SDL needed.
+ *
+ * Usage: pmxaot ROM OUT.c
+ *
+ * Loads a binary (.bin) or CSV ROM and writes a C file holding the ROM's
+ * memory image and aot_execute(), the whole program as one function with a
+ * label per basic block (see aot.h). Blocks start at address 0, at every
+ * instruction a POT pushes the address of, and after every jump, halt,
+ * device access and block write. Each block is straight-line C on the PMX's stacks, memory
+ * and registers, so the C compiler optimizes across instructions.
+ *
+ * Jumps whose target was pushed by a POT earlier in the same block go
+ * straight to the target's label, computed targets go through a switch over
+ * all block starts. What the translation cannot run itself is handed to the
+ * interpreter:
+ *
+ *   - a target that is not a block start runs one instruction at a time in
+ *     the interpreter until execution reaches a block start again;
+ *   - a block that does not fit in what is left of the budget is
+ *     interpreted up to the budget, so instruction counts stay exact;
+ *   - a store into the program drops the translation for good, the
+ *     interpreter executes the store and everything after it.
+ *
+ * make aot ROM=program.rom links the output with pmx11 built with -DPMX_AOT,
+ * which starts the translated program instead of reading a ROM file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./pmx.h"
+#include "./rom.h"
+
+#define AOT_STACK 64 // stack slots per block tracked for constant jump targets
+
+typedef struct AotConst {
+    int known;
+    unsigned int value;
+} AotConst;
+
+// What a block has pushed so far, depth is relative to the block's start
+typedef struct AotStack {
+    AotConst slot[AOT_STACK];
+    int depth;
+} AotStack;
+
+typedef struct AotProgram {
+    const unsigned int *words;
+    unsigned int length;        // words of program, the PMX's code_size
+    unsigned char *start;       // 1 where an instruction starts
+    unsigned char *leader;      // 1 where a block starts
+    int uses_resume;
+    int uses_modified;
+} AotProgram;
+
+static void
+stack_push(AotStack *stack, int known, unsigned int value) {
+    if (stack->depth >= 0 && stack->depth < AOT_STACK) {
+        stack->slot[stack->depth] = (AotConst){ known, value };
+    }
+    stack->depth++;
+}
+
+static AotConst
+stack_peek(const AotStack *stack, int below) {
+    int i = stack->depth - 1 - below;
+    if (i < 0 || i >= AOT_STACK) return (AotConst){ 0, 0 };
+    return stack->slot[i];
+}
+
+static void
+stack_pop(AotStack *stack, int count) {
+    stack->depth -= count;
+}
+
+static unsigned int
+insn_words(const AotProgram *program, unsigned int at) {
+    unsigned int length = opcode_length(program->words[at]);
+    return length ? length : 1;
+}
+
+/*
+ * Instructions left to the interpreter: ones cut off by the end of the
+ * program, and MOV with a register operand the interpreter does not check.
+ */
+static int
+translatable(const AotProgram *program, unsigned int at) {
+    const unsigned int *w = program->words;
+    if (at + insn_words(program, at) > program->length) return 0;
+    if (w[at] == 0x20) {
+        if (w[at + 1] == 0 && w[at + 3] - 1 >= REGISTER_NUMBER) return 0;
+        if (w[at + 2] == 0 && w[at + 4] - 1 >= REGISTER_NUMBER) return 0;
+    }
+    return 1;
+}
+
+static int
+ends_block(unsigned int op) {
+    switch (op) {
+    case 0x00: case 0x30: case 0x31: case 0x33: case 0x34:
+    case 0xAF: case 0xBF: case 0xDE: case 0xDF: case 0xEF:
+        return 1;
+    default:
+        return opcode_length(op) == 0;
+    }
+}
+
+static void
+find_blocks(AotProgram *program) {
+    const unsigned int *w = program->words;
+
+    for (unsigned int at = 0; at < program->length; at += insn_words(program, at)) {
+        program->start[at] = 1;
+    }
+    for (unsigned int at = 0; at < program->length; at += insn_words(program, at)) {
+        unsigned int next = at + insn_words(program, at);
+        if (w[at] == 0x11 && next <= program->length && w[at + 1] < program->length && program->start[w[at + 1]]) {
+            program->leader[w[at + 1]] = 1;
+        }
+        if ((ends_block(w[at]) || !translatable(program, at)) && next < program->length) {
+            program->leader[next] = 1;
+        }
+    }
+    if (program->length > 0) program->leader[0] = 1;
+    for (unsigned int at = 0; at < program->length; at++) {
+        if (program->leader[at] && !translatable(program, at)) program->leader[at] = 0;
+    }
+}
+
+// Instructions in the block starting at at
+static int
+block_length(const AotProgram *program, unsigned int at) {
+    int count = 0;
+    do {
+        if (!translatable(program, at)) break;
+        count++;
+        if (ends_block(program->words[at])) break;
+        at += insn_words(program, at);
+    } while (at < program->length && !program->leader[at]);
+    return count;
+}
+
+// Continue at a jump target the block pushed itself, or look it up
+static void
+emit_jump(FILE *out, const AotProgram *program, AotConst target, const char *computed) {
+    if (target.known && target.value < program->length && program->leader[target.value]) {
+        fprintf(out, "goto b_%u;", target.value);
+    } else {
+        fprintf(out, "pc = %s; goto dispatch;", computed);
+    }
+}
+
+static void
+emit_insn(FILE *out, AotProgram *program, AotStack *stack, unsigned int at, int left) {
+    const unsigned int *w = program->words;
+    unsigned int op = w[at];
+    unsigned int arg = at + 1 < program->length ? w[at + 1] : 0;
+
+    const char *name = opcode_length(op) == 0 ? "UNKNOWN" : get_assembly_instruction(op);
+    fprintf(out, "    /* %04x %-8s */ ", at, name);
+    if (op >= 0x01 && op <= 0x08) {
+        fprintf(out, "reg[%u] = (int)0x%xu;\n", op - 1, arg);
+        return;
+    }
+    switch (op) {
+    case 0x00:
+        fprintf(out, "SYNC(); halt(pmx, *running); RELOAD(); *running = 0; return count;\n");
+        break;
+    case 0x09:
+        fprintf(out, "wst[sp - 1] = wst[sp] + wst[sp - 1]; sp--;\n");
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x0A:
+        fprintf(out, "wst[sp - 1] = wst[sp] - wst[sp - 1]; sp--;\n");
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x0B:
+        if (arg - 1 < REGISTER_NUMBER) {
+            fprintf(out, "wst[++sp] = reg[%u];\n", arg - 1);
+            stack_push(stack, 0, 0);
+        } else {
+            fprintf(out, "/* no register %u */\n", arg);
+        }
+        break;
+    case 0x0C:
+        if (arg - 1 < REGISTER_NUMBER) {
+            fprintf(out, "reg[%u] = wst[sp--];\n", arg - 1);
+            stack_pop(stack, 1);
+        } else {
+            fprintf(out, "/* no register %u */\n", arg);
+        }
+        break;
+    case 0x0D:
+        fprintf(out, "wst[sp - 1] = wst[sp] == wst[sp - 1] ? 0 : 1; sp--;\n");
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x0E:
+        fprintf(out, "wst[sp - 1] = (int)wst[sp] > (int)wst[sp - 1] ? 0 : 1; sp--;\n");
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x0F:
+        fprintf(out, "wst[sp - 1] = (int)wst[sp] < (int)wst[sp - 1] ? 0 : 1; sp--;\n");
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x15: case 0x16: case 0x17: case 0x18:
+    case 0x19: case 0x1A: case 0x1B: case 0x1C: {
+        static const char *const expr[] = {
+            "wst[sp] * wst[sp - 1]",
+            "int_div((int)wst[sp], (int)wst[sp - 1])",
+            "int_mod((int)wst[sp], (int)wst[sp - 1])",
+            "wst[sp] & wst[sp - 1]",
+            "wst[sp] | wst[sp - 1]",
+            "wst[sp] ^ wst[sp - 1]",
+            "wst[sp] << (wst[sp - 1] & 31)",
+            "wst[sp] >> (wst[sp - 1] & 31)",
+        };
+        fprintf(out, "wst[sp - 1] = %s; sp--;\n", expr[op - 0x15]);
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    }
+    case 0x10: {
+        AotConst top = stack_peek(stack, 0);
+        fprintf(out, "wst[sp + 1] = wst[sp]; sp++;\n");
+        stack_push(stack, top.known, top.value);
+        break;
+    }
+    case 0x11:
+        fprintf(out, "wst[++sp] = 0x%xu;\n", arg);
+        stack_push(stack, 1, arg);
+        break;
+    case 0x12: {
+        AotConst second = stack_peek(stack, 1);
+        fprintf(out, "wst[sp + 1] = wst[sp - 1]; sp++;\n");
+        stack_push(stack, second.known, second.value);
+        break;
+    }
+    case 0x13:
+    case 0x14:
+        fprintf(out, "wst[sp]%s;\n", op == 0x13 ? "++" : "--");
+        stack_pop(stack, 1);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x20: {
+        unsigned int src = w[at + 3], dst = w[at + 4];
+        fprintf(out, "{ unsigned int value = ");
+        if (w[at + 1] == 0) {
+            fprintf(out, "reg[%u]; ", src - 1);
+        } else {
+            fprintf(out, "mem[0x%xu]; ", src);
+        }
+        if (w[at + 2] == 0) {
+            fprintf(out, "reg[%u] = value; }\n", dst - 1);
+        } else if (dst < program->length) {
+            fprintf(out, "(void)value; pc = 0x%x; count -= %d; goto modified; }\n", at, left);
+            program->uses_modified = 1;
+        } else {
+            fprintf(out, "mem[0x%xu] = value; }\n", dst);
+        }
+        break;
+    }
+    case 0x23:
+        fprintf(out, "wst[sp - 1] = int_pow((int)wst[sp], (int)wst[sp - 1]); sp--;\n");
+        stack_pop(stack, 2);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x24:
+        fprintf(out, "wst[sp] = int_sqrt((int)wst[sp]);\n");
+        stack_pop(stack, 1);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x25:
+        fprintf(out, "wst[sp] = abs((int)wst[sp]);\n");
+        stack_pop(stack, 1);
+        stack_push(stack, 0, 0);
+        break;
+    case 0x30:
+    case 0x31:
+    case 0x33:
+    case 0x34: {
+        // Block writes may hit the program, the PMX's own functions check
+        const char *block = op == 0x30 ? "block_copy" : op == 0x31 ? "block_fill" : op == 0x33 ? "block_add" : "block_scale";
+        fprintf(out, "pc = 0x%x; SYNC(); %s(pmx); goto resume;\n", at, block);
+        program->uses_resume = 1;
+        stack_pop(stack, 3);
+        break;
+    }
+    case 0x32:
+    case 0x35:
+        fprintf(out, "wst[sp - 2] = %s(pmx, wst[sp], wst[sp - 1], wst[sp - 2]); sp -= 2;\n",
+                op == 0x32 ? "memory_compare" : "memory_dot");
+        stack_pop(stack, 3);
+        stack_push(stack, 0, 0);
+        break;
+    case 0xAA: {
+        // Stores to an address pushed in the block need no check when it is data
+        AotConst addr = stack_peek(stack, 0);
+        if (!addr.known || addr.value < program->length) {
+            fprintf(out, "if (wst[sp] < CODE_SIZE) { pc = 0x%x; count -= %d; goto modified; } ", at, left);
+            program->uses_modified = 1;
+        }
+        fprintf(out, "mem[wst[sp]] = wst[sp - 1]; sp -= 2;\n");
+        stack_pop(stack, 2);
+        break;
+    }
+    case 0xAF:
+        fprintf(out, "if (pmx->ports[0x%02x].output != NULL) { pc = 0x%x; SYNC(); "
+                     "pmx->ports[0x%02x].output(pmx, 0x%02x); goto resume; }\n", arg & 0xFF, at + 2, arg & 0xFF, arg & 0xFF);
+        program->uses_resume = 1;
+        break;
+    case 0xBF:
+        fprintf(out, "pmx->dev[0x%02x] = wst[sp--]; if (pmx->ports[0x%02x].write != NULL) { pc = 0x%x; SYNC(); "
+                     "pmx->ports[0x%02x].write(pmx, 0x%02x); goto resume; }\n",
+                arg & 0xFF, arg & 0xFF, at + 2, arg & 0xFF, arg & 0xFF);
+        program->uses_resume = 1;
+        stack_pop(stack, 1);
+        break;
+    case 0xDE: {
+        // The target stays on the stack under the return address
+        AotConst target = stack_peek(stack, 0);
+        fprintf(out, "{ unsigned int target = wst[sp]; wst[++sp] = 0x%xu; (void)target; ", at + 1);
+        emit_jump(out, program, target, "target");
+        fprintf(out, " }\n");
+        break;
+    }
+    case 0xDF: {
+        AotConst target = stack_peek(stack, 0);
+        fprintf(out, "{ unsigned int target = wst[sp--]; (void)target; ");
+        emit_jump(out, program, target, "target");
+        fprintf(out, " }\n");
+        break;
+    }
+    case 0xEE:
+        fprintf(out, "sp--;\n");
+        stack_pop(stack, 1);
+        break;
+    case 0xEF: {
+        // The target is only popped when the jump is taken
+        AotConst target = stack_peek(stack, 1);
+        fprintf(out, "if (wst[sp--] != 0) { unsigned int target = wst[sp--]; (void)target; ");
+        emit_jump(out, program, target, "target");
+        fprintf(out, " }\n");
+        stack_pop(stack, 1);
+        break;
+    }
+    case 0xFE:
+        fprintf(out, "wst[++sp] = 0x%xu;\n", at);
+        stack_push(stack, 1, at);
+        break;
+    case 0xFF:
+        fprintf(out, "rst[++rp] = wst[sp--];\n");
+        stack_pop(stack, 1);
+        break;
+    case 0x1CF:
+    case 0x2CF:
+    case 0x3CF:
+        fprintf(out, "{ int r1 = wst[sp--]; int r2 = wst[sp--]; int temp = reg[r1 - 1]; "
+                     "reg[r1 - 1] = reg[r2 - 1]; reg[r2 - 1] = temp; }\n");
+        stack_pop(stack, 2);
+        break;
+    default:
+        // Unknown opcodes stop the machine without counting, like the interpreter
+        fprintf(out, "pc = 0x%x; count -= 1; SYNC(); *running = 0; return count;\n", at);
+        break;
+    }
+}
+
+static void
+emit_image(FILE *out, const char *name, const unsigned int *words, unsigned int count) {
+    fprintf(out, "static int %s[%u] = {", name, count ? count : 1);
+    for (unsigned int i = 0; i < count; i++) {
+        fprintf(out, "%s0x%x,", i % 10 == 0 ? "\n    " : " ", words[i]);
+    }
+    fprintf(out, "%s\n};\n\n", count ? "" : " 0");
+}
+
+static void
+emit_program(FILE *out, AotProgram *program, const PMX *pmx, const char *rom) {
+    // Anything a binary ROM put in memory past the program is loaded too
+    unsigned int data_first = program->length, data_end = program->length;
+    for (unsigned int i = program->length; i < (unsigned int)pmx->memory_size; i++) {
+        if (pmx->memory[i] == 0) continue;
+        if (data_end == program->length) data_first = i;
+        data_end = i + 1;
+    }
+
+    fprintf(out, "/*\n * Generated by pmxaot from %s, do not edit.\n", rom);
+    fprintf(out, " * %u words of program in %s.\n */\n\n", program->length, "blocks labelled by address");
+    fprintf(out, "#include <stdlib.h>\n#include <string.h>\n#include \"aot.h\"\n\n");
+    fprintf(out, "#define CODE_SIZE 0x%xu\n", program->length);
+    fprintf(out, "#define DATA_ADDR 0x%xu\n", data_first);
+    fprintf(out, "#define DATA_SIZE 0x%xu\n\n", data_end - data_first);
+    fprintf(out, "#define SYNC()   do { pmx->pc = pc; pmx->sp = sp; pmx->rp = rp; } while (0)\n");
+    fprintf(out, "#define RELOAD() do { pc = pmx->pc; sp = pmx->sp; rp = pmx->rp; } while (0)\n\n");
+    emit_image(out, "aot_code", program->words, program->length);
+    emit_image(out, "aot_data", pmx->memory + data_first, data_end - data_first);
+
+    fprintf(out, "int\naot_load(PMX *pmx) {\n");
+    fprintf(out, "    if ((unsigned int)pmx->memory_size < DATA_ADDR + DATA_SIZE) return 0;\n");
+    fprintf(out, "    memcpy(pmx->memory, aot_code, CODE_SIZE * sizeof(int));\n");
+    fprintf(out, "    memcpy(pmx->memory + DATA_ADDR, aot_data, DATA_SIZE * sizeof(int));\n");
+    fprintf(out, "    pmx->registers[7] = %d;\n", pmx->registers[7]);
+    fprintf(out, "    pmx->steps = %d;\n", pmx->steps);
+    fprintf(out, "    predecode_reset(pmx, CODE_SIZE);\n");
+    fprintf(out, "    pmx->native = pmx->verified ? aot_execute : NULL;\n");
+    fprintf(out, "    return 1;\n}\n\n");
+
+    fprintf(out, "long\naot_execute(PMX *pmx, long budget, int *running) {\n");
+    fprintf(out, "    unsigned int *mem = pmx->memory;\n");
+    fprintf(out, "    unsigned int *wst = pmx->wst;\n");
+    fprintf(out, "    unsigned int *rst = pmx->rst;\n");
+    fprintf(out, "    int *reg = pmx->registers;\n");
+    fprintf(out, "    int pc = pmx->pc;\n");
+    fprintf(out, "    int sp = pmx->sp;\n");
+    fprintf(out, "    int rp = pmx->rp;\n");
+    fprintf(out, "    long count = 0;\n\n");
+    fprintf(out, "    (void)mem; (void)rst; (void)reg;\n");
+    fprintf(out, "    if (budget <= 0) return 0;\n\n");
+
+    fprintf(out, "dispatch:\n    switch (pc) {\n");
+    for (unsigned int at = 0; at < program->length; at++) {
+        if (program->leader[at]) fprintf(out, "    case 0x%x: goto b_%u;\n", at, at);
+    }
+    fprintf(out, "    default: goto interpret_one;\n    }\n\n");
+
+    AotStack stack = { .depth = 0 };
+    int left = 0;
+    for (unsigned int at = 0; at < program->length; at += insn_words(program, at)) {
+        if (program->leader[at]) {
+            int length = block_length(program, at);
+            fprintf(out, "b_%u:\n", at);
+            fprintf(out, "    if (count + %d > budget) { pc = 0x%x; goto finish; }\n", length, at);
+            fprintf(out, "    count += %d;\n", length);
+            stack.depth = 0;
+            left = length;
+        }
+        if (!translatable(program, at)) {
+            fprintf(out, "    pc = 0x%x; goto dispatch;\n", at);
+            continue;
+        }
+        emit_insn(out, program, &stack, at, left);
+        left--;
+    }
+    fprintf(out, "    pc = 0x%x; goto dispatch;\n\n", program->length);
+
+    fprintf(out, "interpret_one:\n");
+    fprintf(out, "    SYNC();\n    count += interpret(pmx, 1, running);\n    RELOAD();\n");
+    fprintf(out, "    if (!*running || count >= budget) return count;\n");
+    fprintf(out, "    if (pmx->native == NULL) goto finish;\n    goto dispatch;\n\n");
+    if (program->uses_resume) {
+        fprintf(out, "resume:\n    RELOAD();\n    if (pmx->native == NULL) goto finish;\n    goto dispatch;\n\n");
+    }
+    if (program->uses_modified) {
+        fprintf(out, "modified:\n    pmx->native = NULL;\n");
+    }
+    fprintf(out, "finish:\n    SYNC();\n    return count + interpret(pmx, budget - count, running);\n}\n");
+}
+
+int
+main(int argc, char* args[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: pmxaot ROM OUT.c\n");
+        return 2;
+    }
+
+    PMX pmx;
+    if (!init_pmx_config(&pmx, &pmx_default_config)) return 1;
+    size_t length = strlen(args[1]);
+    int binary = length > 4 && strcmp(args[1] + length - 4, ".bin") == 0;
+    if (!(binary ? load_rom(&pmx, args[1]) : load_program_from_file(&pmx, args[1]))) {
+        free_pmx(&pmx);
+        return 1;
+    }
+
+    AotProgram program = {
+        .words = pmx.memory,
+        .length = pmx.code_size,
+        .start = calloc(pmx.code_size + 1, 1),
+        .leader = calloc(pmx.code_size + 1, 1),
+    };
+    FILE *out = fopen(args[2], "w");
+    if (program.start == NULL || program.leader == NULL || out == NULL) {
+        perror("pmxaot");
+        if (out != NULL) fclose(out);
+        free(program.start);
+        free(program.leader);
+        free_pmx(&pmx);
+        return 1;
+    }
+
+    find_blocks(&program);
+    emit_program(out, &program, &pmx, args[1]);
+    int ok = !ferror(out);
+    ok &= fclose(out) == 0;
+    if (!ok) perror("pmxaot");
+
+    free(program.start);
+    free(program.leader);
+    free_pmx(&pmx);
+    return ok ? 0 : 1;
+}
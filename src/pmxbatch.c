@@ -0,0 +1,256 @@
+/**
+ * @file pmxbatch.c
+ * @brief Headless batch runner for directories of ROMs.
+ *
+ * Usage: pmxbatch DIR [--jobs N] [--limit N] [--slice N] [--console]
+ * Runs every .bin (binary) and .rom (CSV) file in DIR on its own PMX and
+ * in-memory display, spread over a pool of worker threads. Each ROM runs
+ * until it halts (with the same step cap as pmx11) or reaches the
+ * instruction limit, refreshing the display every slice instructions like a
+ * frame of pmx11 --cycles. One line is printed per ROM, sorted by name,
+ * followed by a summary:
+ *
+ *   name status instructions ms frames hash
+ *
+ * status is "halted", "limit" or "error" (the ROM failed to load). Console
+ * output of the ROMs is dropped unless --console is given. The exit code is
+ * 1 when any ROM failed to load.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "./pmx.h"
+#include "./devices/display.h"
+#include "./devices/console.h"
+#include "./rom.h"
+
+enum BATCH_STATUS {
+    BATCH_HALTED,
+    BATCH_LIMIT,
+    BATCH_ERROR
+};
+
+static const char *batch_status_names[] = { "halted", "limit", "error" };
+
+typedef struct BatchJob {
+    char *path;
+    const char *name;  // file name part of path
+    int status;
+    long instructions;
+    double ms;
+    int frames;
+    Uint64 hash;
+} BatchJob;
+
+typedef struct Batch {
+    BatchJob *jobs;
+    int job_count;
+    atomic_int next;  // next job a worker picks up
+    long limit;       // instructions per ROM, 0 for no limit
+    int slice;        // instructions per frame
+    int console;
+} Batch;
+
+static double
+now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int
+has_suffix(const char *name, const char *suffix) {
+    size_t length = strlen(name), suffix_length = strlen(suffix);
+    return length > suffix_length && strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+static int
+compare_jobs(const void *a, const void *b) {
+    return strcmp(((const BatchJob *)a)->name, ((const BatchJob *)b)->name);
+}
+
+static int
+cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+/**
+ * @brief Collect the ROM files of a directory as jobs, sorted by name.
+ *
+ * @return The number of jobs, -1 if the directory can't be read.
+ */
+static int
+batch_collect(Batch *batch, const char *dir) {
+    DIR *handle = opendir(dir);
+    if (handle == NULL) {
+        perror("Error opening ROM directory");
+        return -1;
+    }
+
+    int capacity = 0;
+    struct dirent *entry;
+    batch->jobs = NULL;
+    batch->job_count = 0;
+    while ((entry = readdir(handle)) != NULL) {
+        if (!has_suffix(entry->d_name, ".bin") && !has_suffix(entry->d_name, ".rom")) continue;
+        if (batch->job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            BatchJob *grown = realloc(batch->jobs, capacity * sizeof(BatchJob));
+            if (grown == NULL) break;
+            batch->jobs = grown;
+        }
+        size_t length = strlen(dir) + strlen(entry->d_name) + 2;
+        BatchJob *job = &batch->jobs[batch->job_count];
+        memset(job, 0, sizeof(*job));
+        job->path = malloc(length);
+        if (job->path == NULL) break;
+        snprintf(job->path, length, "%s/%s", dir, entry->d_name);
+        job->name = job->path + strlen(dir) + 1;
+        batch->job_count++;
+    }
+    closedir(handle);
+
+    qsort(batch->jobs, batch->job_count, sizeof(BatchJob), compare_jobs);
+    return batch->job_count;
+}
+
+/**
+ * @brief Run one ROM to completion or to the instruction limit.
+ *
+ * Everything the run touches is local to this call, so any number of them
+ * can run at the same time.
+ */
+static void
+batch_run(const Batch *batch, BatchJob *job) {
+    PMX pmx;
+    PMXDisplay display = { 0 };
+    double start = now_ms();
+
+    job->status = BATCH_ERROR;
+    if (!init_pmx_config(&pmx, &pmx_default_config)) return;
+    if (!initDisplay(&display, &display_memory_backend, 0x000)) {
+        free_pmx(&pmx);
+        return;
+    }
+    display_register(&pmx, &display);
+    if (!batch->console) {
+        register_device(&pmx, CONSOLE_FIRST, CONSOLE_LAST, NULL, NULL);
+    }
+
+    int loaded = has_suffix(job->name, ".bin") ? load_rom(&pmx, job->path)
+                                               : load_program_from_file(&pmx, job->path);
+    if (loaded) {
+        long limit = batch->limit > 0 ? batch->limit : -1;
+        long executed = 0;
+        while (pmx.step < pmx.steps && executed != limit) {
+            long budget = batch->slice;
+            if (limit > 0 && limit - executed < budget) budget = limit - executed;
+            long done = step_n(&pmx, budget);
+            executed += done;
+            pmx.time += done;
+            display_frame(&pmx);
+            display_update(&display);
+            console_flush(pmx.console);
+        }
+        display_frame(&pmx);
+        display_update(&display);
+
+        job->status = pmx.step < pmx.steps ? BATCH_LIMIT : BATCH_HALTED;
+        job->instructions = executed;
+        job->frames = display.frame;
+        job->hash = display_hash(&display);
+    }
+
+    closeDisplay(&display);
+    free_pmx(&pmx);
+    job->ms = now_ms() - start;
+}
+
+static void *
+batch_worker(void *arg) {
+    Batch *batch = arg;
+    int index;
+    while ((index = atomic_fetch_add(&batch->next, 1)) < batch->job_count) {
+        batch_run(batch, &batch->jobs[index]);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char* args[]) {
+    const char *dir = NULL;
+    int jobs = cpu_count();
+    Batch batch = { .limit = 0, .slice = 100000 };
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? args[i + 1] : "";
+        if (strcmp(args[i], "--jobs") == 0) {
+            jobs = atoi(value); i++;
+        } else if (strcmp(args[i], "--limit") == 0) {
+            batch.limit = atol(value); i++;
+        } else if (strcmp(args[i], "--slice") == 0) {
+            batch.slice = atoi(value); i++;
+        } else if (strcmp(args[i], "--console") == 0) {
+            batch.console = 1;
+        } else {
+            dir = args[i];
+        }
+    }
+    if (dir == NULL || jobs <= 0 || batch.slice <= 0) {
+        fprintf(stderr, "Usage: pmxbatch DIR [--jobs N] [--limit N] [--slice N] [--console]\n");
+        return 1;
+    }
+    if (batch_collect(&batch, dir) < 0) return 1;
+    if (jobs > batch.job_count) jobs = batch.job_count;
+    atomic_init(&batch.next, 0);
+
+    double start = now_ms();
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; workers != NULL && i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, batch_worker, &batch) != 0) break;
+        started++;
+    }
+    // Without any worker thread the main thread runs the batch itself
+    if (started == 0) batch_worker(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    double elapsed = now_ms() - start;
+
+    int counts[3] = { 0, 0, 0 };
+    long total = 0;
+    for (int i = 0; i < batch.job_count; i++) {
+        BatchJob *job = &batch.jobs[i];
+        printf("%s %s %ld %.3f %d %016llx\n", job->name, batch_status_names[job->status],
+               job->instructions, job->ms, job->frames, (unsigned long long)job->hash);
+        counts[job->status]++;
+        total += job->instructions;
+        free(job->path);
+    }
+    free(batch.jobs);
+
+    printf("# %d roms: %d halted, %d limit, %d error; %ld instructions in %.3f ms on %d threads (%.1f MIPS)\n",
+           batch.job_count, counts[BATCH_HALTED], counts[BATCH_LIMIT], counts[BATCH_ERROR],
+           total, elapsed, started, elapsed > 0 ? total / elapsed / 1000.0 : 0.0);
+    return counts[BATCH_ERROR] ? 1 : 0;
+}
@@ -0,0 +1,338 @@
+/**
+ * @file pmxbench.c
+ * @brief Interpreter benchmarks, no SDL needed.
+ *
+ * Usage: pmxbench [--reps N] [--scale F] [--jit] [rom...]
+ * Runs a set of opcode microbenchmarks and workloads through run(), plus the
+ * given ROM files, and prints one CSV line per benchmark:
+ *
+ *   name,instructions,seconds,mips,ns_per_op,allocs,alloc_bytes
+ *
+ * Every benchmark is run reps times (default 5) and the fastest run is
+ * reported. allocs and alloc_bytes count the malloc/calloc/realloc calls made
+ * while the program runs, which is why pmxbench is linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (see the makefile).
+ * --scale multiplies the iteration counts of the built-in programs, --jit
+ * runs everything with the JIT on (needs a build with make JIT=1).
+ *
+ * The microbenchmarks repeat the measured instructions BENCH_UNROLL times
+ * inside a counted loop, so the loop itself is a small part of the count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "./pmx.h"
+#include "./rom.h"
+#include "./jit.h"
+#include "./devices/display.h"
+
+#define BENCH_UNROLL 16
+#define BENCH_WORDS 1024
+#define BENCH_DATA 0x10000 // scratch memory for the store benchmarks
+
+// Opcodes used by the benchmark programs
+enum BENCH_OP {
+    OP_HALT = 0x00, OP_LOAD1 = 0x01, OP_ADD = 0x09, OP_PSH = 0x0B, OP_POP = 0x0C,
+    OP_DUP = 0x10, OP_POT = 0x11, OP_OVR = 0x12, OP_DCR = 0x14, OP_MOV = 0x20,
+    OP_STR = 0xAA, OP_DVW = 0xBF, OP_GOTO = 0xDE, OP_RMV = 0xEE, OP_JNZ = 0xEF
+};
+
+typedef struct BenchProgram {
+    int words[BENCH_WORDS];
+    int length;
+    int loop;  // start of the loop body
+} BenchProgram;
+
+typedef struct BenchResult {
+    long instructions;
+    double seconds;
+    long allocs;
+    long alloc_bytes;
+} BenchResult;
+
+typedef void (*BenchBody)(BenchProgram *program);
+
+typedef struct Bench {
+    const char *name;
+    BenchBody prelude;  // runs once before the loop, may be NULL
+    BenchBody body;     // one repetition of the measured instructions
+    int unroll;         // repetitions of body per loop iteration
+    long iterations;
+    int display;        // attach a memory display
+    int stepped;        // drive the program with step() instead of run()
+} Bench;
+
+/*
+ * Allocation counters, fed by the --wrap'd allocator below.
+ */
+static long alloc_count;
+static long alloc_bytes;
+
+static int bench_jit;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count, size_t size) {
+    alloc_count++;
+    alloc_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+static double
+now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+emit(BenchProgram *program, int count, const int *words) {
+    for (int i = 0; i < count && program->length < BENCH_WORDS; i++) {
+        program->words[program->length++] = words[i];
+    }
+}
+
+#define EMIT(program, ...) \
+    emit(program, sizeof((int[]){ __VA_ARGS__ }) / sizeof(int), (int[]){ __VA_ARGS__ })
+
+/*
+ * Counted loop around the body: R1 holds the iterations left. JNZ leaves its
+ * target on the stack when it falls through, RMV drops it before the halt.
+ */
+static void
+build_program(BenchProgram *program, const Bench *bench) {
+    program->length = 0;
+    EMIT(program, OP_LOAD1, (int)bench->iterations);
+    if (bench->prelude != NULL) bench->prelude(program);
+    program->loop = program->length;
+    for (int i = 0; i < bench->unroll; i++) {
+        bench->body(program);
+    }
+    EMIT(program, OP_PSH, 1, OP_DCR, OP_POP, 1);
+    EMIT(program, OP_POT, program->loop, OP_PSH, 1, OP_JNZ, OP_RMV, OP_HALT);
+}
+
+static void prelude_zero(BenchProgram *p) { EMIT(p, OP_POT, 0); }
+static void prelude_pair(BenchProgram *p) { EMIT(p, OP_POT, 1, OP_POT, 2); }
+static void body_none(BenchProgram *p) { (void)p; }
+static void body_add(BenchProgram *p) { EMIT(p, OP_POT, 1, OP_ADD); }
+static void body_dup_ovr(BenchProgram *p) { EMIT(p, OP_DUP, OP_RMV, OP_OVR, OP_RMV); }
+static void body_push_pop(BenchProgram *p) { EMIT(p, OP_PSH, 2, OP_POP, 3); }
+static void body_str(BenchProgram *p) { EMIT(p, OP_POT, 7, OP_POT, BENCH_DATA, OP_STR); }
+static void body_mov_rr(BenchProgram *p) { EMIT(p, OP_MOV, 0, 0, 2, 3); }
+static void body_mov_rm(BenchProgram *p) { EMIT(p, OP_MOV, 0, 1, 2, BENCH_DATA); }
+static void body_mov_mr(BenchProgram *p) { EMIT(p, OP_MOV, 1, 0, BENCH_DATA, 3); }
+static void body_mov_mm(BenchProgram *p) { EMIT(p, OP_MOV, 1, 1, BENCH_DATA, BENCH_DATA + 1); }
+
+// GOTO to the next instruction, then drop the target and the return address
+static void
+body_goto(BenchProgram *p) {
+    EMIT(p, OP_POT, p->length + 3, OP_GOTO, OP_RMV, OP_RMV);
+}
+
+// R2 += R1 every iteration
+static void
+body_sum(BenchProgram *p) {
+    EMIT(p, OP_PSH, 2, OP_PSH, 1, OP_ADD, OP_POP, 2);
+}
+
+// One character record at the start of display memory, drawn at (10, 10) scale 4 in white
+static void
+prelude_text(BenchProgram *p) {
+    int record[] = { 0x01, 10, 10, 4, 0xfff };
+    for (int i = 0; i < 5; i++) {
+        EMIT(p, OP_POT, record[i], OP_POT, DISPLAY_BLOCK + i, OP_STR);
+    }
+}
+
+// Swap the character between A and B, redrawing the screen after each store
+static void
+body_text(BenchProgram *p) {
+    EMIT(p, OP_POT, 0x02, OP_POT, DISPLAY_BLOCK, OP_STR, OP_POT, 1, OP_DVW, 0x12);
+    EMIT(p, OP_POT, 0x01, OP_POT, DISPLAY_BLOCK, OP_STR, OP_POT, 1, OP_DVW, 0x12);
+}
+
+static const Bench benches[] = {
+    { "jnz_loop",  NULL,          body_none,     0,            4000000, 0, 0 },
+    { "add",       prelude_zero,  body_add,      BENCH_UNROLL, 500000,  0, 0 },
+    { "dup_ovr",   prelude_pair,  body_dup_ovr,  BENCH_UNROLL, 250000,  0, 0 },
+    { "push_pop",  NULL,          body_push_pop, BENCH_UNROLL, 500000,  0, 0 },
+    { "str",       NULL,          body_str,      BENCH_UNROLL, 250000,  0, 0 },
+    { "mov_rr",    NULL,          body_mov_rr,   BENCH_UNROLL, 1000000, 0, 0 },
+    { "mov_rm",    NULL,          body_mov_rm,   BENCH_UNROLL, 1000000, 0, 0 },
+    { "mov_mr",    NULL,          body_mov_mr,   BENCH_UNROLL, 1000000, 0, 0 },
+    { "mov_mm",    NULL,          body_mov_mm,   BENCH_UNROLL, 1000000, 0, 0 },
+    { "goto",      NULL,          body_goto,     BENCH_UNROLL, 250000,  0, 0 },
+    { "sum_loop",  NULL,          body_sum,      1,            2000000, 0, 0 },
+    { "sum_step",  NULL,          body_sum,      1,            500000,  0, 1 },
+    { "text",      prelude_text,  body_text,     1,            20000,   1, 0 },
+};
+
+static int
+bench_open(PMX *pmx, PMXDisplay *display, int with_display) {
+    if (!init_pmx_config(pmx, &pmx_default_config)) return 0;
+    if (bench_jit && jit_open(pmx) == NULL) {
+        free_pmx(pmx);
+        return 0;
+    }
+    if (with_display) {
+        if (!initDisplay(display, &display_memory_backend, 0x000)) {
+            jit_close(pmx->jit);
+            free_pmx(pmx);
+            return 0;
+        }
+        display_register(pmx, display);
+    }
+    return 1;
+}
+
+static void
+bench_close(PMX *pmx, PMXDisplay *display, int with_display) {
+    if (with_display) closeDisplay(display);
+    jit_close(pmx->jit);
+    free_pmx(pmx);
+}
+
+/*
+ * Run a loaded program to the end and measure it. A stepped run calls step()
+ * `stepped` times, once per instruction of the program.
+ */
+static void
+bench_measure(PMX *pmx, long stepped, BenchResult *result) {
+    alloc_count = 0;
+    alloc_bytes = 0;
+    double start = now_seconds();
+    if (stepped > 0) {
+        pmx->steps = INT_MAX;
+        for (long i = 0; i < stepped; i++) {
+            step(pmx);
+        }
+        result->instructions = stepped;
+    } else {
+        result->instructions = run(pmx);
+    }
+    result->seconds = now_seconds() - start;
+    result->allocs = alloc_count;
+    result->alloc_bytes = alloc_bytes;
+}
+
+static void
+bench_keep_best(BenchResult *best, const BenchResult *result, int rep) {
+    if (rep == 0 || result->seconds < best->seconds) *best = *result;
+}
+
+static void
+bench_print(const char *name, const BenchResult *result) {
+    double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+    printf("%s,%ld,%.6f,%.2f,%.3f,%ld,%ld\n", name, result->instructions, seconds,
+           result->instructions / seconds / 1e6, seconds * 1e9 / (result->instructions ? result->instructions : 1),
+           result->allocs, result->alloc_bytes);
+}
+
+static int
+bench_builtin(const Bench *bench, double scale, int reps) {
+    Bench scaled = *bench;
+    BenchProgram program;
+    BenchResult best = { 0 }, result;
+    PMX pmx;
+    PMXDisplay display = { 0 };
+    long stepped = 0;
+
+    scaled.iterations = (long)(bench->iterations * scale);
+    if (scaled.iterations < 1) scaled.iterations = 1;
+    build_program(&program, &scaled);
+
+    for (int rep = 0; rep < reps; rep++) {
+        if (!bench_open(&pmx, &display, bench->display)) return 0;
+        if (!load_program(&pmx, program.words, program.length)) {
+            bench_close(&pmx, &display, bench->display);
+            return 0;
+        }
+        if (bench->stepped && stepped == 0) {
+            // Count the instructions with run() first, then step through a fresh copy
+            stepped = run(&pmx);
+            bench_close(&pmx, &display, bench->display);
+            rep--;
+            continue;
+        }
+        bench_measure(&pmx, stepped, &result);
+        bench_keep_best(&best, &result, rep);
+        bench_close(&pmx, &display, bench->display);
+    }
+    bench_print(bench->name, &best);
+    return 1;
+}
+
+static int
+bench_rom(const char *filename, int reps) {
+    BenchResult best = { 0 }, result;
+    PMX pmx;
+    PMXDisplay display = { 0 };
+
+    for (int rep = 0; rep < reps; rep++) {
+        if (!bench_open(&pmx, &display, 1)) return 0;
+        size_t length = strlen(filename);
+        int binary = length > 4 && strcmp(filename + length - 4, ".bin") == 0;
+        if (!(binary ? load_rom(&pmx, filename) : load_program_from_file(&pmx, filename))) {
+            bench_close(&pmx, &display, 1);
+            return 0;
+        }
+        bench_measure(&pmx, 0, &result);
+        bench_keep_best(&best, &result, rep);
+        bench_close(&pmx, &display, 1);
+    }
+    bench_print(filename, &best);
+    return 1;
+}
+
+int
+main(int argc, char* args[]) {
+    int reps = 5;
+    double scale = 1.0;
+    int ok = 1;
+
+    printf("name,instructions,seconds,mips,ns_per_op,allocs,alloc_bytes\n");
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(args[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(args[++i]);
+        } else if (strcmp(args[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(args[++i]);
+        } else if (strcmp(args[i], "--jit") == 0) {
+            bench_jit = 1;
+        }
+    }
+    if (reps < 1) reps = 1;
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        ok &= bench_builtin(&benches[i], scale, reps);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(args[i], "--reps") == 0 || strcmp(args[i], "--scale") == 0) {
+            i++;
+            continue;
+        }
+        if (strcmp(args[i], "--jit") == 0) continue;
+        ok &= bench_rom(args[i], reps);
+    }
+    return ok ? 0 : 1;
+}
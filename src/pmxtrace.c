@@ -0,0 +1,36 @@
+/**
+ * @file pmxtrace.c
+ * @brief Offline decoder for binary PMX trace files.
+ *
+ * Usage: pmxtrace [trace.bin] [log.txt]
+ * Renders the trace recorded with `pmx11 --trace LEVEL` as text. Reads
+ * ./trace.bin and writes to stdout when no files are given.
+ */
+
+#include <stdio.h>
+#include "./trace.h"
+
+int 
+main(int argc, char* args[]) {
+    const char *input = argc > 1 ? args[1] : "./trace.bin";
+    FILE *in = fopen(input, "rb");
+    if (in == NULL) {
+        perror("Error opening trace file");
+        return 1;
+    }
+    FILE *out = stdout;
+    if (argc > 2) {
+        out = fopen(args[2], "w");
+        if (out == NULL) {
+            perror("Error opening output file");
+            fclose(in);
+            return 1;
+        }
+    }
+
+    int ok = trace_decode(in, out);
+
+    fclose(in);
+    if (out != stdout) fclose(out);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+/**
+ * @file profile.c
+ * @brief Execution profiler: opcode counts, sampled hot pcs, device ports.
+ *
+ * The interpreter counts every executed opcode and every device access, and
+ * records the pc once every PROFILE_PERIOD instructions. The report written
+ * by profile_close() lists the opcode mix, the hottest sampled pcs resolved
+ * to the assembler's labels, and per-port access counts and handler time,
+ * next to the time spent in the VM and in display refreshes.
+ *
+ * Labels come from the symbol file pmxAssembler.py writes next to the ROM,
+ * one "address name" pair per line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./profile.h"
+
+typedef struct ProfileSymbol {
+    Uint32 addr;
+    char name[64];
+} ProfileSymbol;
+
+typedef struct ProfileSymbols {
+    ProfileSymbol *list;
+    int count;
+} ProfileSymbols;
+
+typedef struct ProfileHot {
+    Uint32 pc;
+    Uint32 samples;
+} ProfileHot;
+
+double
+profile_clock(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Start profiling a PMX.
+ *
+ * @param pmx The PMX structure, the profile is attached to it.
+ * @param symbols Symbol file used to name pcs in the report, may be NULL.
+ * @param report File the report is written to on close, NULL for stderr.
+ * @return The profile, NULL if the interpreter was built without the
+ * profiler or allocation failed.
+ */
+PMXProfile *
+profile_open(PMX *pmx, const char *symbols, const char *report) {
+#ifndef PMX_PROFILER
+    (void)pmx; (void)symbols; (void)report;
+    fprintf(stderr, "Profiling needs a build with -DPMX_PROFILER\n");
+    return NULL;
+#else
+    PMXProfile *profile = calloc(1, sizeof(PMXProfile));
+    if (profile == NULL) return NULL;
+    profile->pc_samples = calloc(pmx->memory_size, sizeof(Uint32));
+    if (profile->pc_samples == NULL) {
+        free(profile);
+        return NULL;
+    }
+    profile->sample_size = pmx->memory_size;
+    profile->countdown = PROFILE_PERIOD;
+    profile->symbols = symbols;
+    profile->report = report;
+    pmx->profile = profile;
+    return profile;
+#endif
+}
+
+void
+profile_sample(PMXProfile *profile, unsigned int pc) {
+    profile->countdown = PROFILE_PERIOD;
+    if (pc < (unsigned int)profile->sample_size) profile->pc_samples[pc]++;
+}
+
+static int
+compare_symbols(const void *a, const void *b) {
+    Uint32 x = ((const ProfileSymbol *)a)->addr, y = ((const ProfileSymbol *)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static ProfileSymbols
+load_symbols(const char *filename) {
+    ProfileSymbols symbols = { NULL, 0 };
+    FILE *file = filename != NULL ? fopen(filename, "r") : NULL;
+    if (file == NULL) return symbols;
+
+    int capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ProfileSymbol symbol;
+        if (sscanf(line, "%x %63s", &symbol.addr, symbol.name) != 2) continue;
+        if (symbols.count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ProfileSymbol *grown = realloc(symbols.list, capacity * sizeof(ProfileSymbol));
+            if (grown == NULL) break;
+            symbols.list = grown;
+        }
+        symbols.list[symbols.count++] = symbol;
+    }
+    fclose(file);
+    qsort(symbols.list, symbols.count, sizeof(ProfileSymbol), compare_symbols);
+    return symbols;
+}
+
+// Closest label at or before pc, NULL when there is none
+static const ProfileSymbol *
+find_symbol(const ProfileSymbols *symbols, Uint32 pc) {
+    int low = 0, high = symbols->count - 1;
+    const ProfileSymbol *found = NULL;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (symbols->list[mid].addr <= pc) {
+            found = &symbols->list[mid];
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+static const char *
+opcode_name(unsigned int op) {
+    if (op >= PROFILE_OPCODES) return "UNKNOWN";
+    if ((op & 0xFF) == 0xCF) return "SWAP";
+    return op < 0x100 ? get_assembly_instruction(op) : "UNKNOWN";
+}
+
+static void
+report_opcodes(FILE *out, const PMXProfile *profile, Uint64 total) {
+    fprintf(out, "-- opcodes --\n");
+    for (int op = 0; op <= PROFILE_OPCODES; op++) {
+        if (profile->ops[op] == 0) continue;
+        fprintf(out, "  0x%03x %-10s %12llu %6.2f%%\n", op, opcode_name(op),
+                (unsigned long long)profile->ops[op], 100.0 * profile->ops[op] / total);
+    }
+}
+
+static void
+report_hot(FILE *out, const PMXProfile *profile, const ProfileSymbols *symbols) {
+    ProfileHot hot[PROFILE_TOP];
+    int count = 0;
+    Uint64 samples = 0;
+
+    // Keep the PROFILE_TOP most sampled pcs, sorted, by insertion
+    for (int pc = 0; pc < profile->sample_size; pc++) {
+        Uint32 n = profile->pc_samples[pc];
+        if (n == 0) continue;
+        samples += n;
+        if (count == PROFILE_TOP && n <= hot[count - 1].samples) continue;
+        int i = count < PROFILE_TOP ? count++ : count - 1;
+        while (i > 0 && hot[i - 1].samples < n) {
+            hot[i] = hot[i - 1];
+            i--;
+        }
+        hot[i] = (ProfileHot){ pc, n };
+    }
+
+    fprintf(out, "-- hot pcs (%llu samples, one every %d instructions) --\n",
+            (unsigned long long)samples, PROFILE_PERIOD);
+    for (int i = 0; i < count; i++) {
+        const ProfileSymbol *symbol = find_symbol(symbols, hot[i].pc);
+        char where[96] = "";
+        if (symbol != NULL) snprintf(where, sizeof(where), "%s+%u", symbol->name, hot[i].pc - symbol->addr);
+        fprintf(out, "  0x%06x %-24s %10u %6.2f%%\n", hot[i].pc, where, hot[i].samples,
+                100.0 * hot[i].samples / samples);
+    }
+}
+
+static double
+report_ports(FILE *out, const PMXProfile *profile) {
+    double seconds = 0;
+    fprintf(out, "-- device ports --\n");
+    for (int port = 0; port < 0x100; port++) {
+        if (profile->port_writes[port] == 0 && profile->port_outputs[port] == 0) continue;
+        fprintf(out, "  0x%02x writes %10llu outputs %10llu handler %10.3f ms\n", port,
+                (unsigned long long)profile->port_writes[port],
+                (unsigned long long)profile->port_outputs[port], profile->port_seconds[port] * 1000);
+        seconds += profile->port_seconds[port];
+    }
+    return seconds;
+}
+
+/**
+ * @brief Write the profile report and free the profile.
+ */
+void
+profile_close(PMXProfile *profile) {
+    if (profile == NULL) return;
+
+    FILE *out = profile->report != NULL ? fopen(profile->report, "w") : stderr;
+    if (out == NULL) {
+        perror("Error opening profile report");
+        out = stderr;
+    }
+    ProfileSymbols symbols = load_symbols(profile->symbols);
+    Uint64 total = 0;
+    for (int op = 0; op <= PROFILE_OPCODES; op++) {
+        total += profile->ops[op];
+    }
+
+    fprintf(out, "== PMX profile: %llu instructions ==\n", (unsigned long long)total);
+    report_opcodes(out, profile, total ? total : 1);
+    report_hot(out, profile, &symbols);
+    double device_seconds = report_ports(out, profile);
+    fprintf(out, "-- time --\n");
+    fprintf(out, "  vm      %10.3f ms (%.1f MIPS)\n", (profile->vm_seconds - device_seconds) * 1000,
+            profile->vm_seconds > device_seconds ? total / (profile->vm_seconds - device_seconds) / 1e6 : 0.0);
+    fprintf(out, "  devices %10.3f ms\n", device_seconds * 1000);
+    fprintf(out, "  display %10.3f ms (frame refresh and present)\n", profile->display_seconds * 1000);
+
+    if (out != stderr) fclose(out);
+    free(symbols.list);
+    free(profile->pc_samples);
+    free(profile);
+}
@@ -0,0 +1,47 @@
+#include "./pmx.h"
+
+#ifndef PMX_PROFILE
+#define PMX_PROFILE
+
+#define PROFILE_OPCODES 0x400  // opcode counters, unknown opcodes share one more
+#define PROFILE_PERIOD 997     // instructions between pc samples
+#define PROFILE_TOP 20         // hottest pcs in the report
+
+/**
+ * @brief Execution profile of one PMX.
+ *
+ * The counters are updated by the interpreter itself when it is built with
+ * -DPMX_PROFILER, without that flag the hooks compile to nothing and
+ * profile_open() refuses to start. Device handler time is part of vm_seconds
+ * and is reported separately per port.
+ */
+struct PMXProfile {
+    Uint64 ops[PROFILE_OPCODES + 1];
+    Uint32 *pc_samples;        // samples per address, memory_size entries
+    int sample_size;
+    int countdown;             // instructions until the next pc sample
+    Uint64 port_writes[0x100];
+    Uint64 port_outputs[0x100];
+    double port_seconds[0x100];
+    double vm_seconds;         // inside run() and step_n()
+    double display_seconds;    // refreshing and presenting frames
+    const char *symbols;       // symbol file written by the assembler
+    const char *report;        // report file, NULL for stderr
+};
+
+#ifdef PMX_PROFILER
+#define PROFILE_TIME(pmx, field, statement) do { \
+        double profile_start_ = (pmx)->profile ? profile_clock() : 0; \
+        statement; \
+        if ((pmx)->profile) (pmx)->profile->field += profile_clock() - profile_start_; \
+    } while (0)
+#else
+#define PROFILE_TIME(pmx, field, statement) do { statement; } while (0)
+#endif
+
+PMXProfile *profile_open(PMX *pmx, const char *symbols, const char *report);
+void profile_close(PMXProfile *profile);
+void profile_sample(PMXProfile *profile, unsigned int pc);
+double profile_clock(void);
+
+#endif
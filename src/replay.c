@@ -0,0 +1,168 @@
+/**
+ * @file replay.c
+ * @brief Input log for deterministic record and replay of emulator runs.
+ *
+ * Given its inputs, the VM is deterministic, and everything that reaches it
+ * from outside enters at a frame boundary, where pmx->step says exactly how
+ * many instructions have run. Recording writes each input event with that
+ * count. Replaying reads them back, and the emulator runs each frame up to
+ * the next event's count exactly and delivers the event there. The program
+ * sees the same input at the same instruction, however fast the replay
+ * runs.
+ *
+ * The log stays small: one record per event, with the count stored as the
+ * distance from the previous event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./replay.h"
+
+struct PMXReplay {
+    FILE *file;
+    int writing;
+    long last;          // step of the last event written or read
+    int ok;             // no write failed, or the next event is valid
+    ReplayEvent next;   // read ahead while replaying
+};
+
+static void
+write_count(FILE *file, unsigned long value) {
+    do {
+        Uint8 byte = value & 0x7F;
+        value >>= 7;
+        fputc(value != 0 ? byte | 0x80 : byte, file);
+    } while (value != 0);
+}
+
+static int
+read_count(FILE *file, unsigned long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) return 0;
+        *value |= (unsigned long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+    return 0;
+}
+
+// Read the following event into replay->next, clears ok at the end of the log
+static void
+read_ahead(PMXReplay *replay) {
+    unsigned long delta, length;
+    int kind;
+
+    replay->ok = 0;
+    if (!read_count(replay->file, &delta)) return;
+    kind = fgetc(replay->file);
+    if (kind == EOF || !read_count(replay->file, &length)) {
+        fprintf(stderr, "Truncated input log event after step %ld\n", replay->last);
+        return;
+    }
+    if (length > REPLAY_DATA_MAX || fread(replay->next.data, 1, length, replay->file) != length) {
+        fprintf(stderr, "Invalid input log event after step %ld\n", replay->last);
+        return;
+    }
+    replay->next.step = replay->last + (long)delta;
+    replay->next.kind = kind;
+    replay->next.length = (int)length;
+    replay->ok = 1;
+}
+
+/**
+ * @brief Start recording input events into filename.
+ *
+ * @return The recorder, NULL if the file could not be created.
+ */
+PMXReplay *
+replay_record(const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to create input log: %s\n", filename);
+        return NULL;
+    }
+    PMXReplay *replay = calloc(1, sizeof(PMXReplay));
+    if (replay == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    ReplayHeader header = { REPLAY_MAGIC, REPLAY_VERSION, sizeof(ReplayHeader) };
+    replay->file = file;
+    replay->writing = 1;
+    replay->ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    return replay;
+}
+
+/**
+ * @brief Open an input log recorded by replay_record() for replay.
+ *
+ * @return The replay, NULL if the file is missing or not an input log.
+ */
+PMXReplay *
+replay_open(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open input log: %s\n", filename);
+        return NULL;
+    }
+    ReplayHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != REPLAY_MAGIC ||
+        header.version != REPLAY_VERSION || header.header_size < sizeof(header) ||
+        fseek(file, header.header_size, SEEK_SET) != 0) {
+        fprintf(stderr, "Not a version %d PMX input log: %s\n", REPLAY_VERSION, filename);
+        fclose(file);
+        return NULL;
+    }
+    PMXReplay *replay = calloc(1, sizeof(PMXReplay));
+    if (replay == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    replay->file = file;
+    read_ahead(replay);
+    return replay;
+}
+
+void
+replay_close(PMXReplay *replay) {
+    if (replay == NULL) return;
+    if (replay->writing && (fflush(replay->file) != 0 || !replay->ok)) {
+        fprintf(stderr, "Failed to write input log\n");
+    }
+    fclose(replay->file);
+    free(replay);
+}
+
+// Append an event that arrived at step, data longer than REPLAY_DATA_MAX is cut
+void
+replay_log(PMXReplay *replay, long step, int kind, const void *data, int length) {
+    if (replay == NULL || !replay->writing) return;
+    if (length > REPLAY_DATA_MAX) length = REPLAY_DATA_MAX;
+    write_count(replay->file, (unsigned long)(step - replay->last));
+    fputc(kind, replay->file);
+    write_count(replay->file, (unsigned long)length);
+    if (length > 0 && fwrite(data, 1, length, replay->file) != (size_t)length) replay->ok = 0;
+    replay->last = step;
+}
+
+// Step of the next event to replay, -1 once all have been taken
+long
+replay_next(const PMXReplay *replay) {
+    if (replay == NULL || replay->writing || !replay->ok) return -1;
+    return replay->next.step;
+}
+
+/**
+ * @brief Take the next event to replay.
+ *
+ * @return 1 with the event in *event, 0 once all have been taken.
+ */
+int
+replay_take(PMXReplay *replay, ReplayEvent *event) {
+    if (replay_next(replay) < 0) return 0;
+    *event = replay->next;
+    replay->last = replay->next.step;
+    read_ahead(replay);
+    return 1;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include "./pmx.h"
+
+#ifndef PMX_REPLAY
+#define PMX_REPLAY
+
+#define REPLAY_MAGIC 0x49584D50 // "PMXI"
+#define REPLAY_VERSION 1
+#define REPLAY_DATA_MAX 256     // bytes of data one event carries at most
+
+enum REPLAY_KIND {
+    REPLAY_QUIT = 1,     // the window was closed
+    REPLAY_CONSOLE = 2   // data = bytes that arrived on stdin for the console
+};
+
+/**
+ * @brief Header of an input log.
+ *
+ * It is followed by one record per event, in the order they arrived: the
+ * instructions executed since the previous event (since 0 for the first),
+ * the kind, the data length and the data. Counts and lengths are unsigned
+ * LEB128, the header is little-endian.
+ */
+typedef struct ReplayHeader {
+    Uint32 magic;
+    Uint16 version;
+    Uint16 header_size;
+} ReplayHeader;
+
+typedef struct ReplayEvent {
+    long step;   // pmx->step the event arrived at
+    int kind;
+    int length;
+    Uint8 data[REPLAY_DATA_MAX];
+} ReplayEvent;
+
+typedef struct PMXReplay PMXReplay;
+
+PMXReplay *replay_record(const char *filename);
+PMXReplay *replay_open(const char *filename);
+void replay_close(PMXReplay *replay);
+void replay_log(PMXReplay *replay, long step, int kind, const void *data, int length);
+long replay_next(const PMXReplay *replay);
+int replay_take(PMXReplay *replay, ReplayEvent *event);
+
+#endif
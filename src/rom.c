@@ -0,0 +1,161 @@
+/**
+ * @file rom.c
+ * @brief Loader for binary ROM files.
+ *
+ * A binary ROM holds the same words as a CSV program.rom, already encoded, so
+ * loading is a header check and a memcpy per segment. On POSIX systems the
+ * file is mapped instead of read, the segments are copied straight from the
+ * mapping into VM memory.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./rom.h"
+
+#ifdef _WIN32
+#define ROM_MMAP 0
+#else
+#define ROM_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+Uint32
+rom_checksum(Uint32 adler, const Uint8 *data, size_t length) {
+    Uint32 a = adler & 0xFFFF;
+    Uint32 b = adler >> 16;
+
+    while (length > 0) {
+        // 5552 is the largest block that cannot overflow b before the modulo
+        size_t block = length < 5552 ? length : 5552;
+        length -= block;
+        while (block--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static int
+rom_segment_fits(PMX *pmx, Uint32 addr, Uint32 words) {
+    Uint32 size = pmx->memory_size;
+    return addr <= size && words <= size - addr;
+}
+
+static int
+load_rom_image(PMX *pmx, const Uint8 *image, size_t size, const char *filename) {
+    RomHeader header;
+
+    if (size < sizeof(header)) {
+        fprintf(stderr, "ROM too small: %s\n", filename);
+        return 0;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (header.magic != ROM_MAGIC || header.version != ROM_VERSION ||
+        header.header_size < sizeof(header) || header.header_size > size) {
+        fprintf(stderr, "Not a version %d PMX ROM: %s\n", ROM_VERSION, filename);
+        return 0;
+    }
+
+    size_t code_bytes = (size_t)header.code_words * sizeof(Uint32);
+    size_t data_bytes = (size_t)header.data_words * sizeof(Uint32);
+    if (size - header.header_size < code_bytes + data_bytes ||
+        !rom_segment_fits(pmx, header.code_addr, header.code_words) ||
+        !rom_segment_fits(pmx, header.data_addr, header.data_words)) {
+        fprintf(stderr, "Truncated or oversized ROM: %s\n", filename);
+        return 0;
+    }
+
+    const Uint8 *code = image + header.header_size;
+    const Uint8 *data = code + code_bytes;
+    if (rom_checksum(rom_checksum(1, code, code_bytes), data, data_bytes) != header.checksum) {
+        fprintf(stderr, "ROM checksum mismatch: %s\n", filename);
+        return 0;
+    }
+
+    memcpy(pmx->memory + header.code_addr, code, code_bytes);
+    memcpy(pmx->memory + header.data_addr, data, data_bytes);
+    pmx->registers[7] = header.code_words;
+    pmx->steps = header.code_words;
+    predecode_reset(pmx, header.code_addr + header.code_words);
+    return 1;
+}
+
+/**
+ * @brief Map a whole file read-only.
+ *
+ * Uses mmap on POSIX systems and reads the file into a buffer elsewhere.
+ * Release the image with rom_unmap_file().
+ *
+ * @param filename The file to map.
+ * @param size Set to the file size.
+ * @return The file contents, NULL if the file is missing or empty.
+ */
+const Uint8 *
+rom_map_file(const char *filename, size_t *size) {
+    Uint8 *image = NULL;
+#if ROM_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image == MAP_FAILED) image = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+#else
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    image = length > 0 ? malloc(length) : NULL;
+    if (image != NULL && fread(image, 1, length, file) != (size_t)length) {
+        free(image);
+        image = NULL;
+    }
+    *size = length;
+    fclose(file);
+#endif
+    return image;
+}
+
+void
+rom_unmap_file(const Uint8 *image, size_t size) {
+#if ROM_MMAP
+    munmap((void *)image, size);
+#else
+    (void)size;
+    free((void *)image);
+#endif
+}
+
+/**
+ * @brief Load a binary ROM into VM memory.
+ *
+ * Has the same effect on the PMX as load_program_from_file() on the CSV
+ * version of the program, plus copying the data segment.
+ *
+ * @param pmx The PMX structure.
+ * @param filename The binary ROM to load.
+ * @return 1 on success, 0 if the file is missing or not a valid ROM.
+ */
+int
+load_rom(PMX *pmx, const char *filename) {
+    size_t size;
+    const Uint8 *image = rom_map_file(filename, &size);
+    if (image == NULL) return 0;
+
+    int loaded = load_rom_image(pmx, image, size, filename);
+    rom_unmap_file(image, size);
+    return loaded;
+}
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include "./pmx.h"
+
+#ifndef PMX_ROM
+#define PMX_ROM
+
+#define ROM_MAGIC 0x52584D50 // "PMXR"
+#define ROM_VERSION 1
+
+/**
+ * @brief Header of a binary ROM file.
+ *
+ * All fields and segment words are little-endian 32-bit values. The code
+ * segment follows the header and the data segment follows the code, the
+ * checksum is the Adler-32 of both segments' bytes. pmxAssembler.py
+ * writes code segments only, its data segments are empty.
+ */
+typedef struct RomHeader {
+    Uint32 magic;
+    Uint16 version;
+    Uint16 header_size;
+    Uint32 code_addr;
+    Uint32 code_words;
+    Uint32 data_addr;
+    Uint32 data_words;
+    Uint32 checksum;
+    Uint32 reserved;
+} RomHeader;
+
+Uint32 rom_checksum(Uint32 adler, const Uint8 *data, size_t length);
+int load_rom(PMX *pmx, const char *filename);
+const Uint8 *rom_map_file(const char *filename, size_t *size);
+void rom_unmap_file(const Uint8 *image, size_t size);
+
+#endif
@@ -0,0 +1,322 @@
+/**
+ * @file snapshot.c
+ * @brief Whole-machine snapshots.
+ *
+ * A snapshot holds everything needed to resume a VM where it stopped: the
+ * registers, device words and counters, and the pages of memory, of both
+ * stacks and of the attached display's framebuffer that are not all zeros.
+ * Loading maps the file and copies the stored pages into fresh zeroed
+ * buffers, so a machine can boot straight into the state a ROM's setup code
+ * left behind.
+ *
+ * A snapshot can only be loaded into a VM with the same memory layout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./snapshot.h"
+#include "./rom.h"
+#include "./devices/display.h"
+
+typedef struct SnapshotWriter {
+    FILE *file;
+    Uint32 checksum;
+    int ok;
+} SnapshotWriter;
+
+// A region of a snapshot image: page numbers and the pages they refer to
+typedef struct SnapshotRegion {
+    const Uint8 *index;
+    const Uint8 *pages;
+    Uint32 count;
+} SnapshotRegion;
+
+static void
+snapshot_write(SnapshotWriter *writer, const void *data, size_t bytes) {
+    if (bytes == 0) return;
+    writer->checksum = rom_checksum(writer->checksum, data, bytes);
+    if (fwrite(data, 1, bytes, writer->file) != bytes) writer->ok = 0;
+}
+
+// Bytes in page `page` of a region of `size` bytes, the last page may be short
+static size_t
+page_bytes(size_t size, Uint32 page) {
+    size_t left = size - (size_t)page * SNAPSHOT_PAGE_SIZE;
+    return left < SNAPSHOT_PAGE_SIZE ? left : SNAPSHOT_PAGE_SIZE;
+}
+
+static Uint32
+page_total(size_t size) {
+    return (size + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+}
+
+static int
+page_is_zero(const Uint8 *bytes, size_t count) {
+    Uint8 bits = 0;
+    for (size_t i = 0; i < count; i++) {
+        bits |= bytes[i];
+    }
+    return bits == 0;
+}
+
+/*
+ * Write the non-zero pages of a region, index first. `index` needs room for
+ * every page of the region. Returns the number of pages written.
+ */
+static Uint32
+snapshot_write_region(SnapshotWriter *writer, const void *data, size_t size, Uint32 *index) {
+    const Uint8 *bytes = data;
+    Uint32 count = 0;
+    for (Uint32 page = 0; page < page_total(size); page++) {
+        if (!page_is_zero(bytes + (size_t)page * SNAPSHOT_PAGE_SIZE, page_bytes(size, page))) {
+            index[count++] = page;
+        }
+    }
+    snapshot_write(writer, index, count * sizeof(Uint32));
+    for (Uint32 i = 0; i < count; i++) {
+        snapshot_write(writer, bytes + (size_t)index[i] * SNAPSHOT_PAGE_SIZE, page_bytes(size, index[i]));
+    }
+    return count;
+}
+
+/**
+ * @brief Save the whole machine state to a snapshot file.
+ *
+ * @param pmx The PMX structure, its display is saved too when attached.
+ * @param filename The snapshot file to write.
+ * @return 1 on success, 0 if the file could not be written.
+ */
+int
+snapshot_save(PMX *pmx, const char *filename) {
+    const PMXDisplay *display = pmx->display;
+    int has_display = display != NULL && display->buffer != NULL;
+    size_t pixel_bytes = has_display ? (size_t)display->width * display->height * sizeof(Uint16) : 0;
+    size_t most = pixel_bytes;
+    if ((size_t)pmx->memory_size * sizeof(Uint32) > most) most = (size_t)pmx->memory_size * sizeof(Uint32);
+    if ((size_t)pmx->wst_size * sizeof(Uint32) > most) most = (size_t)pmx->wst_size * sizeof(Uint32);
+    if ((size_t)pmx->rst_size * sizeof(Uint32) > most) most = (size_t)pmx->rst_size * sizeof(Uint32);
+    Uint32 *index = malloc(page_total(most) * sizeof(Uint32));
+    if (index == NULL) {
+        fprintf(stderr, "Failed to allocate the snapshot page index\n");
+        return 0;
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror("Error opening snapshot file");
+        free(index);
+        return 0;
+    }
+
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .header_size = sizeof(SnapshotHeader),
+        .memory_size = pmx->memory_size,
+        .wst_size = pmx->wst_size,
+        .rst_size = pmx->rst_size,
+        .display_block = pmx->display_block,
+        .display_size = pmx->display_size,
+        .display_width = has_display ? display->width : 0,
+        .display_height = has_display ? display->height : 0,
+    };
+    SnapshotState state = {
+        .sp = pmx->sp, .rp = pmx->rp, .pc = pmx->pc,
+        .step = pmx->step, .steps = pmx->steps, .time = pmx->time,
+        .code_size = pmx->code_size,
+    };
+    memcpy(state.registers, pmx->registers, sizeof(state.registers));
+    memcpy(state.dev, pmx->dev, sizeof(state.dev));
+
+    // The header goes first with a placeholder checksum and is rewritten once the body is out
+    SnapshotWriter writer = { file, 1, fwrite(&header, sizeof(header), 1, file) == 1 };
+    snapshot_write(&writer, &state, sizeof(state));
+    // Slots above sp are dead but the interpreter spills into them at frame ends, clear them so
+    // the same state always saves to the same bytes
+    memset(pmx->wst + (pmx->sp + 1), 0, (size_t)(pmx->wst_size - (pmx->sp + 1)) * sizeof(Uint32));
+    header.memory_pages = snapshot_write_region(&writer, pmx->memory, pmx->memory_size * sizeof(Uint32), index);
+    header.wst_pages = snapshot_write_region(&writer, pmx->wst, pmx->wst_size * sizeof(Uint32), index);
+    header.rst_pages = snapshot_write_region(&writer, pmx->rst, pmx->rst_size * sizeof(Uint32), index);
+    if (has_display) {
+        header.display_pages = snapshot_write_region(&writer, display->buffer, pixel_bytes, index);
+    }
+
+    header.checksum = writer.checksum;
+    if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1) writer.ok = 0;
+    if (fclose(file) != 0) writer.ok = 0;
+    free(index);
+    if (!writer.ok) fprintf(stderr, "Failed to write snapshot: %s\n", filename);
+    return writer.ok;
+}
+
+// Next `bytes` of the image, NULL when the image is too short
+static const Uint8 *
+snapshot_take(const Uint8 **cursor, size_t *left, size_t bytes) {
+    if (*left < bytes) return NULL;
+    const Uint8 *data = *cursor;
+    *cursor += bytes;
+    *left -= bytes;
+    return data;
+}
+
+static Uint32
+region_page(const SnapshotRegion *region, Uint32 i) {
+    Uint32 page;
+    memcpy(&page, region->index + i * sizeof(Uint32), sizeof(page));
+    return page;
+}
+
+// Locate a region of `size` bytes in the image, 0 if it is truncated or out of range
+static int
+snapshot_take_region(const Uint8 **cursor, size_t *left, size_t size, Uint32 count, SnapshotRegion *region) {
+    region->count = count;
+    region->index = snapshot_take(cursor, left, (size_t)count * sizeof(Uint32));
+    region->pages = *cursor;
+    if (region->index == NULL) return 0;
+    for (Uint32 i = 0; i < count; i++) {
+        Uint32 page = region_page(region, i);
+        if (page >= page_total(size) || snapshot_take(cursor, left, page_bytes(size, page)) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Copy the stored pages of a region into `dst`, which must be zeroed
+static void
+snapshot_restore_region(const SnapshotRegion *region, void *dst, size_t size) {
+    const Uint8 *data = region->pages;
+    for (Uint32 i = 0; i < region->count; i++) {
+        Uint32 page = region_page(region, i);
+        size_t bytes = page_bytes(size, page);
+        memcpy((Uint8 *)dst + (size_t)page * SNAPSHOT_PAGE_SIZE, data, bytes);
+        data += bytes;
+    }
+}
+
+static int
+snapshot_load_image(PMX *pmx, const Uint8 *image, size_t size, const char *filename) {
+    SnapshotHeader header;
+    SnapshotState state;
+    PMXDisplay *display = pmx->display;
+
+    if (size < sizeof(header)) {
+        fprintf(stderr, "Snapshot too small: %s\n", filename);
+        return 0;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.header_size < sizeof(header) || header.header_size > size) {
+        fprintf(stderr, "Not a version %d PMX snapshot: %s\n", SNAPSHOT_VERSION, filename);
+        return 0;
+    }
+    if (header.memory_size != (Uint32)pmx->memory_size || header.wst_size != (Uint32)pmx->wst_size ||
+        header.rst_size != (Uint32)pmx->rst_size || header.display_block != (Uint32)pmx->display_block ||
+        header.display_size != (Uint32)pmx->display_size) {
+        fprintf(stderr, "Snapshot memory layout differs from the VM: %s\n", filename);
+        return 0;
+    }
+    int restore_display = header.display_width != 0 && display != NULL && display->buffer != NULL;
+    if (restore_display && (header.display_width != (Uint32)display->width ||
+                            header.display_height != (Uint32)display->height)) {
+        fprintf(stderr, "Snapshot framebuffer size differs from the display: %s\n", filename);
+        return 0;
+    }
+
+    // Locate every part before touching the machine
+    const Uint8 *body = image + header.header_size;
+    const Uint8 *cursor = body;
+    size_t left = size - header.header_size;
+    SnapshotRegion memory, wst, rst, pixels;
+    size_t memory_bytes = (size_t)header.memory_size * sizeof(Uint32);
+    size_t wst_bytes = (size_t)header.wst_size * sizeof(Uint32);
+    size_t rst_bytes = (size_t)header.rst_size * sizeof(Uint32);
+    size_t pixel_bytes = (size_t)header.display_width * header.display_height * sizeof(Uint16);
+    const Uint8 *state_data = snapshot_take(&cursor, &left, sizeof(state));
+    if (state_data == NULL ||
+        !snapshot_take_region(&cursor, &left, memory_bytes, header.memory_pages, &memory) ||
+        !snapshot_take_region(&cursor, &left, wst_bytes, header.wst_pages, &wst) ||
+        !snapshot_take_region(&cursor, &left, rst_bytes, header.rst_pages, &rst) ||
+        !snapshot_take_region(&cursor, &left, pixel_bytes, header.display_pages, &pixels)) {
+        fprintf(stderr, "Truncated or oversized snapshot: %s\n", filename);
+        return 0;
+    }
+    if (rom_checksum(1, body, cursor - body) != header.checksum) {
+        fprintf(stderr, "Snapshot checksum mismatch: %s\n", filename);
+        return 0;
+    }
+
+    memcpy(&state, state_data, sizeof(state));
+    if (state.sp < -1 || state.sp >= pmx->wst_size || state.rp < -1 || state.rp >= pmx->rst_size ||
+        state.code_size < 0 || state.code_size > pmx->memory_size) {
+        fprintf(stderr, "Snapshot holds an invalid machine state: %s\n", filename);
+        return 0;
+    }
+
+    // Fresh zeroed buffers, only the stored pages get written
+    unsigned int *new_memory = calloc(header.memory_size, sizeof(unsigned int));
+    unsigned int *new_wst = calloc(header.wst_size, sizeof(unsigned int));
+    unsigned int *new_rst = calloc(header.rst_size, sizeof(unsigned int));
+    if (new_memory == NULL || new_wst == NULL || new_rst == NULL) {
+        fprintf(stderr, "Error: failed to allocate PMX memory\n");
+        free(new_memory);
+        free(new_wst);
+        free(new_rst);
+        return 0;
+    }
+    snapshot_restore_region(&memory, new_memory, memory_bytes);
+    snapshot_restore_region(&wst, new_wst, wst_bytes);
+    snapshot_restore_region(&rst, new_rst, rst_bytes);
+    free(pmx->memory);
+    free(pmx->wst);
+    free(pmx->rst);
+    pmx->memory = new_memory;
+    pmx->wst = new_wst;
+    pmx->rst = new_rst;
+
+    pmx->sp = state.sp;
+    pmx->rp = state.rp;
+    pmx->pc = state.pc;
+    pmx->step = state.step;
+    pmx->steps = state.steps;
+    pmx->time = state.time;
+    memcpy(pmx->registers, state.registers, sizeof(state.registers));
+    memcpy(pmx->dev, state.dev, sizeof(state.dev));
+    predecode_reset(pmx, state.code_size);
+
+    if (restore_display) {
+        memset(display->buffer, 0, pixel_bytes);
+        snapshot_restore_region(&pixels, display->buffer, pixel_bytes);
+        // The character records behind the pixels are unknown
+        display->clean = 0;
+        display->record_count = 0;
+        display_invalidate(display);
+        // Framebuffer modes show the restored memory
+        display_sync(pmx);
+    }
+    return 1;
+}
+
+/**
+ * @brief Restore the machine state saved by snapshot_save().
+ *
+ * The VM must have the memory layout the snapshot was taken with. Nothing
+ * is changed when the snapshot is rejected.
+ *
+ * @param pmx The PMX structure, its display is restored too when attached.
+ * @param filename The snapshot file to load.
+ * @return 1 on success, 0 if the file is missing or not a valid snapshot.
+ */
+int
+snapshot_load(PMX *pmx, const char *filename) {
+    size_t size;
+    const Uint8 *image = rom_map_file(filename, &size);
+    if (image == NULL) {
+        fprintf(stderr, "Failed to open snapshot: %s\n", filename);
+        return 0;
+    }
+
+    int loaded = snapshot_load_image(pmx, image, size, filename);
+    rom_unmap_file(image, size);
+    return loaded;
+}
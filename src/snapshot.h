@@ -0,0 +1,49 @@
+#include "./pmx.h"
+
+#ifndef PMX_SNAPSHOT
+#define PMX_SNAPSHOT
+
+#define SNAPSHOT_MAGIC 0x53584D50 // "PMXS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE_SIZE 4096 // bytes
+
+/**
+ * @brief Header of a snapshot file.
+ *
+ * The header is followed by the SnapshotState, then memory, the working
+ * stack, the return stack and the display framebuffer (when one was
+ * attached) as pages: the numbers of the pages holding anything but zeros
+ * followed by those pages. All values are little-endian, the checksum is the
+ * Adler-32 of everything after the header.
+ */
+typedef struct SnapshotHeader {
+    Uint32 magic;
+    Uint16 version;
+    Uint16 header_size;
+    Uint32 memory_size;
+    Uint32 wst_size;
+    Uint32 rst_size;
+    Uint32 display_block;
+    Uint32 display_size;
+    Uint32 memory_pages;    // pages stored for each region
+    Uint32 wst_pages;
+    Uint32 rst_pages;
+    Uint32 display_pages;
+    Uint32 display_width;   // 0 when the snapshot has no framebuffer
+    Uint32 display_height;
+    Uint32 checksum;
+    Uint32 reserved;
+} SnapshotHeader;
+
+typedef struct SnapshotState {
+    Sint32 sp, rp, pc;
+    Sint32 step, steps, time;
+    Sint32 code_size;
+    Sint32 registers[REGISTER_NUMBER];
+    Sint32 dev[0x100];
+} SnapshotState;
+
+int snapshot_save(PMX *pmx, const char *filename);
+int snapshot_load(PMX *pmx, const char *filename);
+
+#endif
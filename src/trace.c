@@ -0,0 +1,336 @@
+/**
+ * @file trace.c
+ * @brief Binary execution trace recorder and its offline decoder.
+ *
+ * The VM thread appends fixed-size TraceRecords to an in-memory ring buffer.
+ * A background thread drains the ring into the trace file, so the VM only
+ * ever pays for a few stores per instruction. The ring never drops records:
+ * when it is full the VM waits for the writer to catch up.
+ *
+ * trace_decode() replays a trace file and renders it in the text format the
+ * old per-instruction log.txt dump used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "./trace.h"
+
+#define TRACE_MASK (TRACE_RING_SIZE - 1)
+
+struct PMXTrace {
+    int level;
+    FILE *file;
+    TraceRecord *ring;
+    atomic_size_t head;  // next record the VM writes
+    atomic_size_t tail;  // next record the writer flushes
+    atomic_int stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    pthread_cond_t space;
+
+    // Last state seen by trace_step, used to only record what changed
+    int primed;
+    int rp;
+    int registers[REGISTER_NUMBER];
+};
+
+static void *
+trace_writer(void *arg) {
+    PMXTrace *trace = arg;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+        if (head == tail) {
+            if (atomic_load(&trace->stop)) break;
+            struct timespec ts;
+            timespec_get(&ts, TIME_UTC);
+            ts.tv_nsec += 10 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&trace->lock);
+            if (atomic_load_explicit(&trace->head, memory_order_acquire) == tail && !atomic_load(&trace->stop)) {
+                pthread_cond_timedwait(&trace->more, &trace->lock, &ts);
+            }
+            pthread_mutex_unlock(&trace->lock);
+            continue;
+        }
+
+        // Write the pending range, split in two when it wraps around the ring
+        while (tail != head) {
+            size_t start = tail & TRACE_MASK;
+            size_t count = head - tail;
+            if (start + count > TRACE_RING_SIZE) count = TRACE_RING_SIZE - start;
+            fwrite(&trace->ring[start], sizeof(TraceRecord), count, trace->file);
+            tail += count;
+        }
+        atomic_store_explicit(&trace->tail, tail, memory_order_release);
+
+        pthread_mutex_lock(&trace->lock);
+        pthread_cond_broadcast(&trace->space);
+        pthread_mutex_unlock(&trace->lock);
+    }
+    fflush(trace->file);
+    return NULL;
+}
+
+static void
+trace_push(PMXTrace *trace, Uint8 kind, Uint8 index, Uint16 opcode, Uint32 a, Uint32 b, Uint32 c) {
+    size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&trace->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+        pthread_mutex_lock(&trace->lock);
+        pthread_cond_signal(&trace->more);
+        while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+            pthread_cond_wait(&trace->space, &trace->lock);
+        }
+        pthread_mutex_unlock(&trace->lock);
+    }
+
+    TraceRecord *record = &trace->ring[head & TRACE_MASK];
+    record->kind = kind;
+    record->index = index;
+    record->opcode = opcode;
+    record->a = a;
+    record->b = b;
+    record->c = c;
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+PMXTrace *
+trace_open(PMX *pmx, const char *filename, int level) {
+    if (level <= TRACE_OFF) return NULL;
+
+    PMXTrace *trace = calloc(1, sizeof(PMXTrace));
+    if (trace == NULL) {
+        fprintf(stderr, "Failed to allocate trace\n");
+        return NULL;
+    }
+    trace->ring = malloc(TRACE_RING_SIZE * sizeof(TraceRecord));
+    trace->file = fopen(filename, "wb");
+    if (trace->ring == NULL || trace->file == NULL) {
+        fprintf(stderr, "Failed to open trace file: %s\n", filename);
+        if (trace->file != NULL) fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    trace->level = level > TRACE_MEMORY ? TRACE_MEMORY : level;
+
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .level = trace->level,
+        .record_size = sizeof(TraceRecord),
+        .display_block = pmx->display_block,
+    };
+    fwrite(&header, sizeof(header), 1, trace->file);
+
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->stop, 0);
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->more, NULL);
+    pthread_cond_init(&trace->space, NULL);
+    if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+        fprintf(stderr, "Failed to start trace writer\n");
+        fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+void
+trace_close(PMXTrace *trace) {
+    if (trace == NULL) return;
+
+    pthread_mutex_lock(&trace->lock);
+    atomic_store(&trace->stop, 1);
+    pthread_cond_signal(&trace->more);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+
+    pthread_cond_destroy(&trace->space);
+    pthread_cond_destroy(&trace->more);
+    pthread_mutex_destroy(&trace->lock);
+    fclose(trace->file);
+    free(trace->ring);
+    free(trace);
+}
+
+/*
+ * The first traced instruction records the whole machine state the decoder
+ * cannot know about, after that only the deltas are written.
+ */
+static void
+trace_prime(PMXTrace *trace, PMX *pmx) {
+    if (trace->level >= TRACE_STACKS) {
+        for (int i = 0; i <= pmx->sp; i++) {
+            trace_push(trace, TRACE_WST, 0, 0, i, i > 0 ? pmx->wst[i - 1] : 0, pmx->wst[i]);
+        }
+        for (int i = 0; i <= pmx->rp; i++) {
+            trace_push(trace, TRACE_RST, 0, 0, i, pmx->rst[i], 0);
+        }
+        for (int i = 0; i < REGISTER_NUMBER; i++) {
+            trace_push(trace, TRACE_REG, i, 0, pmx->registers[i], 0, 0);
+            trace->registers[i] = pmx->registers[i];
+        }
+        trace->rp = pmx->rp;
+    }
+    if (trace->level >= TRACE_MEMORY) {
+        for (int i = 0; i < TRACE_DISPLAY_WORDS && pmx->display_block + i < pmx->memory_size; i++) {
+            int addr = pmx->display_block + i;
+            trace_push(trace, TRACE_MEM, 0, 0, addr, pmx->memory[addr], 0);
+        }
+    }
+    trace->primed = 1;
+}
+
+void
+trace_step(PMXTrace *trace, PMX *pmx, unsigned int opcode) {
+    if (!trace->primed) trace_prime(trace, pmx);
+
+    if (trace->level >= TRACE_STACKS) {
+        int sp = pmx->sp;
+        trace_push(trace, TRACE_WST, 0, 0, sp,
+                   sp > 0 ? pmx->wst[sp - 1] : 0,
+                   sp >= 0 ? pmx->wst[sp] : 0);
+        if (pmx->rp != trace->rp) {
+            trace_push(trace, TRACE_RST, 0, 0, pmx->rp, pmx->rp >= 0 ? pmx->rst[pmx->rp] : 0, 0);
+            trace->rp = pmx->rp;
+        }
+        for (int i = 0; i < REGISTER_NUMBER; i++) {
+            if (pmx->registers[i] != trace->registers[i]) {
+                trace_push(trace, TRACE_REG, i, 0, pmx->registers[i], 0, 0);
+                trace->registers[i] = pmx->registers[i];
+            }
+        }
+    }
+    trace_push(trace, TRACE_OP, 0, opcode, pmx->pc, 0, 0);
+}
+
+void
+trace_mem(PMXTrace *trace, unsigned int addr, unsigned int value) {
+    if (trace->level >= TRACE_MEMORY) {
+        trace_push(trace, TRACE_MEM, 0, 0, addr, value, 0);
+    }
+}
+
+void
+trace_fill(PMXTrace *trace, unsigned int addr, unsigned int count, unsigned int value) {
+    if (trace->level >= TRACE_MEMORY && count > 0) {
+        trace_push(trace, TRACE_FILL, 0, 0, addr, count, value);
+    }
+}
+
+/*
+ * Decoder: shadow copies of the stacks, registers and the display window are
+ * updated from the delta records and printed on every TRACE_OP.
+ */
+typedef struct TraceStack {
+    unsigned int *values;
+    int size;
+    int capacity;
+} TraceStack;
+
+static int
+trace_stack_set(TraceStack *stack, int index, unsigned int value) {
+    if (index < 0) return 1;
+    if (index >= stack->capacity) {
+        int capacity = stack->capacity ? stack->capacity : 256;
+        while (capacity <= index) capacity *= 2;
+        unsigned int *values = realloc(stack->values, capacity * sizeof(unsigned int));
+        if (values == NULL) return 0;
+        stack->values = values;
+        stack->capacity = capacity;
+    }
+    stack->values[index] = value;
+    return 1;
+}
+
+int
+trace_decode(FILE *in, FILE *out) {
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC) {
+        fprintf(stderr, "Not a PMX trace file\n");
+        return 0;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Unsupported trace version %d\n", header.version);
+        return 0;
+    }
+
+    TraceStack wst = {0}, rst = {0};
+    int registers[REGISTER_NUMBER] = {0};
+    unsigned int display[TRACE_DISPLAY_WORDS] = {0};
+    unsigned int base = header.display_block;
+    int ok = 1;
+    TraceRecord record;
+
+    while (ok && fread(&record, sizeof(record), 1, in) == 1) {
+        switch (record.kind) {
+        case TRACE_WST:
+            wst.size = (int)record.a + 1;
+            ok = trace_stack_set(&wst, (int)record.a - 1, record.b) &&
+                 trace_stack_set(&wst, (int)record.a, record.c);
+            break;
+        case TRACE_RST:
+            rst.size = (int)record.a + 1;
+            ok = trace_stack_set(&rst, (int)record.a, record.b);
+            break;
+        case TRACE_REG:
+            if (record.index < REGISTER_NUMBER) registers[record.index] = record.a;
+            break;
+        case TRACE_MEM:
+            if (record.a - base < TRACE_DISPLAY_WORDS) display[record.a - base] = record.b;
+            break;
+        case TRACE_FILL:
+            for (Uint32 i = 0; i < record.b; i++) {
+                if (record.a + i - base < TRACE_DISPLAY_WORDS) display[record.a + i - base] = record.c;
+            }
+            break;
+        case TRACE_OP:
+            if (record.opcode == 0x00) break;
+            fprintf(out, "(%d) \tOPCODE: %x (%s)\n", (int)record.a, record.opcode, get_assembly_instruction(record.opcode));
+            if (header.level >= TRACE_STACKS) {
+                fprintf(out, "\t\tWST: [ ");
+                for (int i = 0; i < wst.size; i++) {
+                    fprintf(out, "%d ", wst.values[i]);
+                }
+                fprintf(out, "]\n");
+                fprintf(out, "\t\tRST: [ ");
+                for (int i = 0; i < rst.size; i++) {
+                    fprintf(out, "%d ", rst.values[i]);
+                }
+                fprintf(out, "]\n");
+                fprintf(out, "\t\tR1=%d, R2=%d, R3=%d, R4=%d, R5=%d, R6=%d, R7=%d, R8=%d\n", registers[0], registers[1], registers[2], registers[3], registers[4], registers[5], registers[6], registers[7]);
+            }
+            if (header.level >= TRACE_MEMORY) {
+                fprintf(out, "\t\tDISPLAY ADDR: [ ");
+                for (int i = 0; i < TRACE_DISPLAY_WORDS; i++) {
+                    fprintf(out, "%d ", display[i]);
+                }
+                fprintf(out, "]\n");
+            }
+            fprintf(out, "-------------------------------------\n");
+            break;
+        default:
+            fprintf(stderr, "Corrupt trace record (kind %d)\n", record.kind);
+            ok = 0;
+            break;
+        }
+    }
+
+    free(wst.values);
+    free(rst.values);
+    return ok;
+}
@@ -0,0 +1,57 @@
+#include "./pmx.h"
+#include <stdio.h>
+
+#ifndef PMX_TRACE
+#define PMX_TRACE
+
+#define TRACE_MAGIC 0x54584D50 // "PMXT"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (1 << 16) // records, must be a power of two
+#define TRACE_DISPLAY_WORDS 101   // words of display memory shown per record
+
+enum TRACE_LEVEL {
+    TRACE_OFF,
+    TRACE_OPCODES,  // pc and opcode of every instruction
+    TRACE_STACKS,   // + stack tops, return stack and register changes
+    TRACE_MEMORY    // + every memory write
+};
+
+enum TRACE_KIND {
+    TRACE_OP,    // a = pc after the instruction, closes the instruction
+    TRACE_WST,   // a = sp, b = wst[sp - 1], c = wst[sp]
+    TRACE_RST,   // a = rp, b = rst[rp]
+    TRACE_REG,   // index = register, a = value
+    TRACE_MEM,   // a = addr, b = value
+    TRACE_FILL   // a = addr, b = count, c = value
+};
+
+/**
+ * @brief Fixed-size binary trace record.
+ *
+ * An instruction is written as its state deltas followed by one TRACE_OP
+ * record, so a decoder can rebuild the machine state by applying records in
+ * order and render it every time it reaches a TRACE_OP.
+ */
+typedef struct TraceRecord {
+    Uint8 kind;
+    Uint8 index;
+    Uint16 opcode;
+    Uint32 a, b, c;
+} TraceRecord;
+
+typedef struct TraceHeader {
+    Uint32 magic;
+    Uint16 version;
+    Uint16 level;
+    Uint32 record_size;
+    Uint32 display_block;
+} TraceHeader;
+
+PMXTrace *trace_open(PMX *pmx, const char *filename, int level);
+void trace_close(PMXTrace *trace);
+void trace_step(PMXTrace *trace, PMX *pmx, unsigned int opcode);
+void trace_mem(PMXTrace *trace, unsigned int addr, unsigned int value);
+void trace_fill(PMXTrace *trace, unsigned int addr, unsigned int count, unsigned int value);
+int trace_decode(FILE *in, FILE *out);
+
+#endif
@@ -1,10 +1,14 @@
 #ifndef UTILS
 #define UTILS
 
+#include <stdint.h>
+
 typedef unsigned char Uint8;
 typedef signed char Sint8;
 typedef unsigned short Uint16;
 typedef signed short Sint16;
 typedef unsigned int Uint32;
+typedef int32_t Sint32;
+typedef uint64_t Uint64;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,373 @@
+/**
+ * @file verify.c
+ * @brief Load-time verifier that lets a program run on the unchecked interpreter.
+ *
+ * The verifier follows every path through the program from the current pc
+ * and the current work stack, keeping the stack depth and every value it
+ * can tell statically (POT operands, return addresses pushed by GOTO and
+ * RPC, arithmetic on those). A program passes when, on every path:
+ *
+ *   - no instruction pops more than the stack holds or pushes past wst_size
+ *   - every jump target is known and inside the program, and the stack has
+ *     the same depth whenever a target is reached
+ *   - STR, MOV, COPY, FILL, VADD and VSCALE store to known addresses past
+ *     the end of the program and inside memory, so the verified code is
+ *     never changed
+ *   - SWAP and MOV name registers that exist
+ *   - execution never runs off the end of the program
+ *   - RET cannot overflow the return stack, which is only proven for
+ *     programs without backward jumps
+ *
+ * Stack values reaching the same jump target with different values become
+ * unknown, so a subroutine called from two places cannot return through a
+ * computed jump and its program runs checked. The verifier is conservative:
+ * it may reject a safe program, never accept an unsafe one.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "./verify.h"
+
+#define VERIFY_UNKNOWN (-1LL)
+
+typedef struct Verifier {
+    const unsigned int *mem;
+    unsigned int code_size;
+    unsigned int memory_size;
+    int limit;                // deepest stack allowed
+    long long **state;        // per pc, the stack merged over jumps to it, NULL until reached
+    int *depth;               // depth of each state
+    unsigned int *work;       // pcs whose state changed and must be walked again
+    int work_count;
+    Uint8 *queued;
+    Uint8 *walked;            // instructions on some path
+    long long *stack;         // the path being walked
+    int sp;                   // its depth
+    int max_depth;
+    int backward;             // some jump goes back, the program may loop
+    int fail_pc;
+    const char *reason;
+} Verifier;
+
+static int
+verify_fail(Verifier *v, unsigned int pc, const char *reason) {
+    if (v->reason == NULL) {
+        v->fail_pc = pc;
+        v->reason = reason;
+    }
+    return 0;
+}
+
+// Record a path reaching target with the walked stack, merged with the ones before it
+static int
+verify_edge(Verifier *v, unsigned int from, unsigned int target) {
+    if (target >= v->code_size) return verify_fail(v, from, "jump outside the program");
+    if (target <= from) v->backward = 1;
+
+    long long *state = v->state[target];
+    int changed = 0;
+    if (state == NULL) {
+        state = malloc((v->sp > 0 ? v->sp : 1) * sizeof(long long));
+        if (state == NULL) return verify_fail(v, target, "out of memory");
+        memcpy(state, v->stack, v->sp * sizeof(long long));
+        v->state[target] = state;
+        v->depth[target] = v->sp;
+        changed = 1;
+    } else if (v->depth[target] != v->sp) {
+        return verify_fail(v, target, "reached with different stack depths");
+    } else {
+        for (int i = 0; i < v->sp; i++) {
+            if (state[i] != v->stack[i] && state[i] != VERIFY_UNKNOWN) {
+                state[i] = VERIFY_UNKNOWN;
+                changed = 1;
+            }
+        }
+    }
+    if (changed && !v->queued[target]) {
+        v->queued[target] = 1;
+        v->work[v->work_count++] = target;
+    }
+    return 1;
+}
+
+// A store target the verified program may write without changing itself
+static int
+verify_store(const Verifier *v, long long addr) {
+    return addr != VERIFY_UNKNOWN && addr >= v->code_size && addr < v->memory_size;
+}
+
+#define NEED(n) do { if (v->sp < (n)) return verify_fail(v, pc, "pops an empty stack"); } while (0)
+#define PUSH(value) do { \
+        long long pushed_ = (value); \
+        if (v->sp >= v->limit) return verify_fail(v, pc, "stack overflow"); \
+        v->stack[v->sp++] = pushed_; \
+        if (v->sp > v->max_depth) v->max_depth = v->sp; \
+    } while (0)
+#define TOP(i) (v->stack[v->sp - 1 - (i)])
+#define KNOWN(a, b) ((a) != VERIFY_UNKNOWN && (b) != VERIFY_UNKNOWN)
+#define WORD(x) ((long long)(unsigned int)(x))
+
+static int
+verify_register(long long r) {
+    return r >= 1 && r <= REGISTER_NUMBER;
+}
+
+// Follow the straight-line path from pc until it jumps, stops or fails
+static int
+verify_walk(Verifier *v, unsigned int pc) {
+    v->sp = v->depth[pc];
+    memcpy(v->stack, v->state[pc], v->sp * sizeof(long long));
+
+    for (;;) {
+        if (pc >= v->code_size) return verify_fail(v, pc, "runs past the end of the program");
+        unsigned int op = v->mem[pc];
+        unsigned int length = opcode_length(op);
+        // An unknown opcode stops the machine
+        if (length == 0) return 1;
+        if (pc + length > v->code_size) return verify_fail(v, pc, "instruction runs past the end of the program");
+        const unsigned int *arg = v->mem + pc + 1;
+        v->walked[pc] = 1;
+
+        switch (op) {
+        case 0x00:
+            return 1;
+        case 0x01: case 0x02: case 0x03: case 0x04:
+        case 0x05: case 0x06: case 0x07: case 0x08:
+            break;
+        case 0x09:
+        case 0x0A:
+        case 0x0D:
+        case 0x0E:
+        case 0x0F:
+        case 0x15: case 0x16: case 0x17: case 0x18:
+        case 0x19: case 0x1A: case 0x1B: case 0x1C:
+        case 0x23: {
+            NEED(2);
+            long long a = TOP(0), b = TOP(1), value = VERIFY_UNKNOWN;
+            if (KNOWN(a, b)) {
+                if (op == 0x09) value = WORD(a + b);
+                if (op == 0x0A) value = WORD(a - b);
+                if (op == 0x0D) value = a == b ? 0 : 1;
+                if (op == 0x0E) value = (int)(unsigned int)a > (int)(unsigned int)b ? 0 : 1;
+                if (op == 0x0F) value = (int)(unsigned int)a < (int)(unsigned int)b ? 0 : 1;
+                if (op == 0x15) value = WORD((unsigned int)a * (unsigned int)b);
+                if (op == 0x16) value = WORD(int_div((int)(unsigned int)a, (int)(unsigned int)b));
+                if (op == 0x17) value = WORD(int_mod((int)(unsigned int)a, (int)(unsigned int)b));
+                if (op == 0x18) value = a & b;
+                if (op == 0x19) value = a | b;
+                if (op == 0x1A) value = a ^ b;
+                if (op == 0x1B) value = WORD((unsigned int)a << (b & 31));
+                if (op == 0x1C) value = WORD((unsigned int)a >> (b & 31));
+                if (op == 0x23) value = WORD(int_pow((int)(unsigned int)a, (int)(unsigned int)b));
+            }
+            v->sp--;
+            TOP(0) = value;
+            break;
+        }
+        case 0x0B:
+            if (arg[0] - 1 < REGISTER_NUMBER) PUSH(VERIFY_UNKNOWN);
+            break;
+        case 0x0C:
+            if (arg[0] - 1 < REGISTER_NUMBER) {
+                NEED(1);
+                v->sp--;
+            }
+            break;
+        case 0x10:
+            NEED(1);
+            PUSH(TOP(0));
+            break;
+        case 0x11:
+            PUSH(arg[0]);
+            break;
+        case 0x12:
+            NEED(2);
+            PUSH(TOP(1));
+            break;
+        case 0x13:
+        case 0x14:
+            NEED(1);
+            if (TOP(0) != VERIFY_UNKNOWN) TOP(0) = WORD(op == 0x13 ? TOP(0) + 1 : TOP(0) - 1);
+            break;
+        case 0x20:
+            // flags select register (0) or memory (1) for the source and destination
+            if (arg[0] == 0 ? arg[2] - 1 >= REGISTER_NUMBER : arg[2] >= v->memory_size) {
+                return verify_fail(v, pc, "MOV source out of range");
+            }
+            if (arg[1] == 0 ? arg[3] - 1 >= REGISTER_NUMBER : !verify_store(v, arg[3])) {
+                return verify_fail(v, pc, "MOV destination out of range");
+            }
+            break;
+        case 0x24:
+        case 0x25:
+            NEED(1);
+            if (TOP(0) != VERIFY_UNKNOWN) {
+                int value = (int)(unsigned int)TOP(0);
+                TOP(0) = WORD(op == 0x24 ? int_sqrt(value) : abs(value));
+            }
+            break;
+        case 0x30:
+        case 0x31:
+        case 0x33:
+        case 0x34:
+            // The range is cut at the end of memory, only where it starts matters
+            NEED(3);
+            if (!verify_store(v, TOP(0))) return verify_fail(v, pc, "block store to an unknown or program address");
+            v->sp -= 3;
+            break;
+        case 0x32:
+        case 0x35:
+            NEED(3);
+            v->sp -= 2;
+            TOP(0) = VERIFY_UNKNOWN;
+            break;
+        case 0xAA:
+            NEED(2);
+            if (!verify_store(v, TOP(0))) return verify_fail(v, pc, "store to an unknown or program address");
+            v->sp -= 2;
+            break;
+        case 0xAF:
+            break;
+        case 0xBF:
+        case 0xEE:
+        case 0xFF:
+            NEED(1);
+            v->sp--;
+            break;
+        case 0xDE: {
+            NEED(1);
+            long long target = TOP(0);
+            if (target == VERIFY_UNKNOWN) return verify_fail(v, pc, "GOTO to an unknown address");
+            PUSH(pc + 1);
+            return verify_edge(v, pc, target);
+        }
+        case 0xDF: {
+            NEED(1);
+            long long target = TOP(0);
+            if (target == VERIFY_UNKNOWN) return verify_fail(v, pc, "JMP to an unknown address");
+            v->sp--;
+            return verify_edge(v, pc, target);
+        }
+        case 0xEF: {
+            NEED(1);
+            long long condition = TOP(0);
+            v->sp--;
+            if (condition != 0) {
+                NEED(1);
+                long long target = TOP(0);
+                if (target == VERIFY_UNKNOWN) return verify_fail(v, pc, "JNZ to an unknown address");
+                v->sp--;
+                if (!verify_edge(v, pc, target)) return 0;
+                if (condition != VERIFY_UNKNOWN) return 1;
+                v->sp++;
+            }
+            break;
+        }
+        case 0xFE:
+            PUSH(pc);
+            break;
+        case 0x1CF:
+        case 0x2CF:
+        case 0x3CF:
+            NEED(2);
+            if (!verify_register(TOP(0)) || !verify_register(TOP(1))) {
+                return verify_fail(v, pc, "SWAP of unknown registers");
+            }
+            v->sp -= 2;
+            break;
+        default:
+            return verify_fail(v, pc, "opcode the verifier does not know");
+        }
+        pc += length;
+    }
+}
+
+/**
+ * @brief Check that the loaded program can run on the unchecked interpreter.
+ *
+ * Verifies memory[0, code_size) starting from the machine's pc, sp and work
+ * stack, so it works for a freshly loaded program and for a restored
+ * snapshot alike. predecode_reset() calls it whenever a program is loaded.
+ *
+ * @param pmx The PMX with the program loaded.
+ * @param result Filled in with the findings, can be NULL.
+ * @return 1 if the program was verified, 0 if it has to run checked.
+ */
+int
+verify_program(const PMX *pmx, VerifyResult *result) {
+    Verifier v = {
+        .mem = pmx->memory,
+        .code_size = pmx->code_size,
+        .memory_size = pmx->memory_size,
+        .limit = pmx->wst_size < VERIFY_DEPTH ? pmx->wst_size : VERIFY_DEPTH,
+        .fail_pc = -1,
+    };
+    unsigned int entry = pmx->pc;
+    int ok = 0;
+
+    v.state = calloc(v.code_size, sizeof(long long *));
+    v.depth = calloc(v.code_size, sizeof(int));
+    v.work = malloc(v.code_size * sizeof(unsigned int));
+    v.queued = calloc(v.code_size, 1);
+    v.walked = calloc(v.code_size, 1);
+    v.stack = malloc(v.limit * sizeof(long long));
+    if (v.state == NULL || v.depth == NULL || v.work == NULL || v.queued == NULL ||
+        v.walked == NULL || v.stack == NULL) {
+        verify_fail(&v, entry, "out of memory");
+        goto done;
+    }
+
+    // The work stack as it is now is where every path starts from
+    v.sp = pmx->sp + 1;
+    if (entry >= v.code_size) {
+        verify_fail(&v, entry, "pc outside the program");
+        goto done;
+    }
+    if (v.sp < 0 || v.sp > v.limit) {
+        verify_fail(&v, entry, "stack too deep to verify");
+        goto done;
+    }
+    for (int i = 0; i < v.sp; i++) {
+        v.stack[i] = pmx->wst[i];
+    }
+    v.max_depth = v.sp;
+    if (!verify_edge(&v, entry, entry)) goto done;
+    v.backward = 0; // the entry is no jump
+
+    while (v.work_count > 0) {
+        unsigned int pc = v.work[--v.work_count];
+        v.queued[pc] = 0;
+        if (!verify_walk(&v, pc)) goto done;
+    }
+
+    // Nothing pops the return stack, so RET is only safe where it runs a bounded number of times
+    long rets = 0;
+    for (unsigned int pc = 0; pc < v.code_size; pc++) {
+        if (v.walked[pc] && v.mem[pc] == 0xFF) rets++;
+    }
+    if (rets > 0 && v.backward) {
+        verify_fail(&v, entry, "RET in a program that may loop");
+    } else if (pmx->rp + 1 + rets > pmx->rst_size) {
+        verify_fail(&v, entry, "return stack overflow");
+    } else {
+        ok = 1;
+    }
+
+done:
+    if (result != NULL) {
+        result->max_depth = v.max_depth;
+        result->pc = ok ? -1 : v.fail_pc;
+        result->reason = ok ? NULL : v.reason;
+    }
+    if (v.state != NULL) {
+        for (unsigned int pc = 0; pc < v.code_size; pc++) {
+            free(v.state[pc]);
+        }
+    }
+    free(v.state);
+    free(v.depth);
+    free(v.work);
+    free(v.queued);
+    free(v.walked);
+    free(v.stack);
+    return ok;
+}
@@ -0,0 +1,19 @@
+#include "./pmx.h"
+
+#ifndef PMX_VERIFY
+#define PMX_VERIFY
+
+#define VERIFY_DEPTH 4096 // deepest work stack the verifier follows, deeper programs run checked
+
+/**
+ * @brief What verify_program() found out about a program.
+ */
+typedef struct VerifyResult {
+    int max_depth;       // deepest the work stack gets on any path
+    int pc;              // where verification failed, -1 if it passed
+    const char *reason;  // why it failed, NULL if it passed
+} VerifyResult;
+
+int verify_program(const PMX *pmx, VerifyResult *result);
+
+#endif